@@ -27,11 +27,93 @@
 #include <cstring>
 
 #include "CM-inl.hpp"
+#include "LZPFilter.hpp"
 #include "X86Binary.hpp"
 #include "Wav16.hpp"
 
 static const bool kTestFilter = false;
 static const size_t kSizePad = 10;
+// Model set selection.
+static const size_t kModelTrialSampleSize = 512 * KB;
+static const size_t kModelTrialMinBlockSize = 4 * kModelTrialSampleSize;
+static const size_t kModelTrialMemUsage = 2;
+static const double kModelTrialTolerance = 0.01;
+// CM levels with nested model sets, smallest first.
+static const Compressor::Type kCMLevels[] = {
+  Compressor::kTypeCMTurbo, Compressor::kTypeCMFast, Compressor::kTypeCMMid,
+  Compressor::kTypeCMHigh, Compressor::kTypeCMMax, Compressor::kTypeCMUltra,
+};
+
+static bool isCMLevel(Compressor::Type type) {
+  return std::find(std::begin(kCMLevels), std::end(kCMLevels), type) != std::end(kCMLevels);
+}
+
+void PrimeData::Train(const FileList& files) {
+  data_.clear();
+  std::vector<const FileInfo*> inputs;
+  uint64_t total_size = 0;
+  for (const auto& f : files) {
+    File fin;
+    if (!f.isDir() && fin.open(f.getFullName(), std::ios_base::in | std::ios_base::binary) == 0) {
+      total_size += fin.length();
+      inputs.push_back(&f);
+    }
+  }
+  // Skip files evenly if they don't all fit.
+  const size_t step = std::max(static_cast<size_t>(1), static_cast<size_t>(total_size / kMaxSize));
+  for (size_t i = 0; i < inputs.size() && data_.size() < kMaxSize; i += step) {
+    File fin;
+    if (fin.open(inputs[i]->getFullName(), std::ios_base::in | std::ios_base::binary) != 0) {
+      continue;
+    }
+    const size_t pos = data_.size();
+    data_.resize(kMaxSize);
+    data_.resize(pos + fin.read(&data_[pos], kMaxSize - pos));
+  }
+}
+
+bool PrimeData::Load(const std::string& file_name, std::ostream& err) {
+  File fin;
+  if (fin.open(file_name, std::ios_base::in | std::ios_base::binary) != 0) {
+    err << "Failed to open prime data " << file_name << std::endl;
+    return false;
+  }
+  char magic[kMagicStringLength] = {};
+  fin.read(reinterpret_cast<uint8_t*>(magic), kMagicStringLength);
+  const uint64_t size = fin.leb128Decode();
+  if (memcmp(magic, getMagic(), kMagicStringLength) != 0 || size > kMaxSize) {
+    err << "Invalid prime data " << file_name << std::endl;
+    return false;
+  }
+  data_.resize(static_cast<size_t>(size));
+  if (size != 0 && fin.read(&data_[0], data_.size()) != data_.size()) {
+    err << "Truncated prime data " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool PrimeData::Save(const std::string& file_name) const {
+  File fout;
+  if (fout.open(file_name, std::ios_base::out | std::ios_base::binary) != 0) {
+    return false;
+  }
+  fout.write(reinterpret_cast<const uint8_t*>(getMagic()), kMagicStringLength);
+  fout.leb128Encode(static_cast<uint64_t>(data_.size()));
+  if (!data_.empty()) {
+    fout.write(&data_[0], data_.size());
+  }
+  return true;
+}
+
+uint64_t PrimeData::Hash() const {
+  // FNV-1a.
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for (uint8_t c : data_) {
+    h = (h ^ c) * 0x100000001B3ULL;
+  }
+  return (h ^ data_.size()) | 1;
+}
 
 Archive::Header::Header() {
   memcpy(magic_, getMagic(), kMagicStringLength);
@@ -53,8 +135,9 @@ bool Archive::Header::isArchive() const {
   return memcmp(magic_, getMagic(), kMagicStringLength) == 0;
 }
 
-bool Archive::Header::isSameVersion() const {
-  return major_version_ == kCurMajorVersion && minor_version_ == kCurMinorVersion;
+bool Archive::Header::isSupportedVersion() const {
+  return version() >= makeVersion(kMinMajorVersion, kMinMinorVersion) &&
+    version() <= makeVersion(kCurMajorVersion, kCurMinorVersion);
 }
 
 Archive::Algorithm::Algorithm(const CompressionOptions& options, Detector::Profile profile) : profile_(profile) {
@@ -65,6 +148,9 @@ Archive::Algorithm::Algorithm(const CompressionOptions& options, Detector::Profi
   if (profile == Detector::kProfileWave16) {
     algorithm_ = Compressor::kTypeWav16;
     // algorithm_ = Compressor::kTypeStore;
+  } else if (profile == Detector::kProfileStore) {
+    // High entropy data, CM would only expand it.
+    algorithm_ = Compressor::kTypeStore;
   } else {
     switch (options.comp_level_) {
     case kCompLevelStore: algorithm_ = Compressor::kTypeStore; break;
@@ -73,6 +159,7 @@ Archive::Algorithm::Algorithm(const CompressionOptions& options, Detector::Profi
     case kCompLevelMid: algorithm_ = Compressor::kTypeCMMid; break;
     case kCompLevelHigh: algorithm_ = Compressor::kTypeCMHigh; break;
     case kCompLevelMax: algorithm_ = Compressor::kTypeCMMax; break;
+    case kCompLevelUltra: algorithm_ = Compressor::kTypeCMUltra; break;
     case kCompLevelSimple: algorithm_ = Compressor::kTypeCMSimple; break;
     }
   }
@@ -85,18 +172,54 @@ Archive::Algorithm::Algorithm(const CompressionOptions& options, Detector::Profi
     lzp_enabled_ = true;
     filter_ = kFilterTypeDict;
     break;
+  case Detector::kProfileStore:
+    // Copied through, the filter and LZP options don't apply.
+    lzp_enabled_ = false;
+    return;
+  }
+  mixer16_ = options.mixer16_ &&
+    (algorithm_ == Compressor::kTypeCMHigh || algorithm_ == Compressor::kTypeCMMax);
+  coder_ = options.coder_type_;
+  if (coder_ == kCoderTypeAuto) {
+    // The coder is a larger share of the time for the levels with few models.
+    coder_ = algorithm_ == Compressor::kTypeCMTurbo || algorithm_ == Compressor::kTypeCMFast ?
+      kCoderTypeRange64 : kCoderTypeRange7;
+  }
+  huffman_ = options.huffman_ && (isCMLevel(algorithm_) || algorithm_ == Compressor::kTypeCMSimple);
+  run_bypass_ = options.run_bypass_;
+  long_match_ = options.long_match_ && (algorithm_ == Compressor::kTypeCMHigh ||
+    algorithm_ == Compressor::kTypeCMMax || algorithm_ == Compressor::kTypeCMUltra);
+  if (isCMLevel(algorithm_)) {
+    profile_set_ = options.cm_profile_set_;
+    if (options.prime_ != nullptr) {
+      prime_ = options.prime_;
+      prime_hash_ = prime_->Hash();
+      // The prime data is not filtered, keep the CM input in the same byte space.
+      filter_ = kFilterTypeNone;
+    }
   }
   // Overrrides.
   if (options.lzp_type_ == kLZPTypeEnable) lzp_enabled_ = true;
   else if (options.lzp_type_ == kLZPTypeDisable) lzp_enabled_ = false;
   // Force filter.
-  if (options.filter_type_ != kFilterTypeAuto) {
+  if (options.filter_type_ != kFilterTypeAuto && options.filter_type_ != kFilterTypeTrial) {
     filter_ = options.filter_type_;
   }
 }
 
-Archive::Algorithm::Algorithm(Stream* stream) {
-  read(stream);
+Archive::Algorithm::Algorithm(Stream* stream, uint32_t version) {
+  read(stream, version);
+}
+
+bool Archive::Algorithm::SetPrime(const std::shared_ptr<PrimeData>& prime) {
+  if (prime_hash_ == 0) {
+    return true;
+  }
+  if (prime == nullptr || prime->Hash() != prime_hash_) {
+    return false;
+  }
+  prime_ = prime;
+  return true;
 }
 
 void Archive::init() {
@@ -113,26 +236,173 @@ Archive::Archive(Stream* stream) : stream_(stream) {
   header_.read(stream_);
 }
 
-Compressor* Archive::Algorithm::CreateCompressor(const FrequencyCounter<256>& freq) {
+template <size_t kInputs, bool kUseSSE, bool kMixer16 = false, size_t kNumMixers = 1>
+static Compressor* createCM(CoderType coder, bool huffman, bool run_bypass, const FrequencyCounter<256>& freq, size_t mem_usage,
+                            bool lzp_enabled, Detector::Profile profile, uint64_t model_mask,
+                            const cm::CMProfileSet* profile_set, const PrimeData* prime, size_t prime_size, uint64_t long_match_size, bool legacy_format) {
+  const std::vector<uint8_t>* prime_data = prime != nullptr ? &prime->Data() : nullptr;
+  if (coder == kCoderTypeRange64) {
+    auto* ret = new cm::CM<kInputs, kUseSSE, kMixer16, kNumMixers, Range64>(freq, mem_usage, lzp_enabled, profile);
+    ret->SetModelMask(model_mask);
+    ret->SetHuffman(huffman);
+    ret->SetRunBypass(run_bypass);
+    ret->SetProfileSet(profile_set);
+    ret->SetPrimeData(prime_data, prime_size);
+    ret->SetLongMatch(long_match_size);
+    ret->SetLegacyFormat(legacy_format);
+    return ret;
+  }
+  auto* ret = new cm::CM<kInputs, kUseSSE, kMixer16, kNumMixers, Range7>(freq, mem_usage, lzp_enabled, profile);
+  ret->SetModelMask(model_mask);
+  ret->SetHuffman(huffman);
+  ret->SetRunBypass(run_bypass);
+  ret->SetProfileSet(profile_set);
+  ret->SetPrimeData(prime_data, prime_size);
+  ret->SetLongMatch(long_match_size);
+  ret->SetLegacyFormat(legacy_format);
+  return ret;
+}
+
+Compressor* Archive::Algorithm::CreateCompressor(const FrequencyCounter<256>& freq, uint64_t block_size) {
+  const uint64_t long_match_size = long_match_ ? block_size : 0;
+  const size_t prime_size = prime_ != nullptr ? prime_->ReplaySize(block_size) : 0;
   switch (algorithm_) {
   case Compressor::kTypeStore: return new Store;
   case Compressor::kTypeWav16: return new Wav16;
-  case Compressor::kTypeCMTurbo: return new cm::CM<3, /*sse*/false>(freq, mem_usage_, lzp_enabled_, profile_);
-  case Compressor::kTypeCMFast: return new cm::CM<4, /*sse*/false>(freq, mem_usage_, lzp_enabled_, profile_);
-  case Compressor::kTypeCMMid: return new cm::CM<6, /*sse*/false>(freq, mem_usage_, lzp_enabled_, profile_);
-  case Compressor::kTypeCMHigh: return new cm::CM<10, /*sse*/false>(freq, mem_usage_, lzp_enabled_, profile_);
-  case Compressor::kTypeCMMax: return new cm::CM<13, /*sse*/true>(freq, mem_usage_, lzp_enabled_, profile_);
-  case Compressor::kTypeCMSimple: return new cm::CM<6, false>(freq, mem_usage_, lzp_enabled_, Detector::kProfileSimple);
+  case Compressor::kTypeCMTurbo: return createCM<3, /*sse*/false>(coder_, huffman_, run_bypass_, freq, mem_usage_, lzp_enabled_, profile_, model_mask_, profile_set_.get(), prime_.get(), prime_size, long_match_size, legacy_format_);
+  case Compressor::kTypeCMFast: return createCM<4, /*sse*/false>(coder_, huffman_, run_bypass_, freq, mem_usage_, lzp_enabled_, profile_, model_mask_, profile_set_.get(), prime_.get(), prime_size, long_match_size, legacy_format_);
+  case Compressor::kTypeCMMid: return createCM<6, /*sse*/false>(coder_, huffman_, run_bypass_, freq, mem_usage_, lzp_enabled_, profile_, model_mask_, profile_set_.get(), prime_.get(), prime_size, long_match_size, legacy_format_);
+  case Compressor::kTypeCMHigh:
+    if (mixer16_) return createCM<10, /*sse*/false, /*mixer16*/true>(coder_, huffman_, run_bypass_, freq, mem_usage_, lzp_enabled_, profile_, model_mask_, profile_set_.get(), prime_.get(), prime_size, long_match_size, legacy_format_);
+    return createCM<10, /*sse*/false>(coder_, huffman_, run_bypass_, freq, mem_usage_, lzp_enabled_, profile_, model_mask_, profile_set_.get(), prime_.get(), prime_size, long_match_size, legacy_format_);
+  case Compressor::kTypeCMMax:
+    if (mixer16_) return createCM<13, /*sse*/true, /*mixer16*/true>(coder_, huffman_, run_bypass_, freq, mem_usage_, lzp_enabled_, profile_, model_mask_, profile_set_.get(), prime_.get(), prime_size, long_match_size, legacy_format_);
+    return createCM<13, /*sse*/true>(coder_, huffman_, run_bypass_, freq, mem_usage_, lzp_enabled_, profile_, model_mask_, profile_set_.get(), prime_.get(), prime_size, long_match_size, legacy_format_);
+  case Compressor::kTypeCMUltra:
+    return createCM<13, /*sse*/true, /*mixer16*/true, /*mixers*/3>(coder_, huffman_, run_bypass_, freq, mem_usage_, lzp_enabled_, profile_, model_mask_, profile_set_.get(), prime_.get(), prime_size, long_match_size, legacy_format_);
+  case Compressor::kTypeCMSimple:
+    return createCM<6, /*sse*/false>(coder_, huffman_, run_bypass_, freq, mem_usage_, lzp_enabled_, Detector::kProfileSimple, 0, nullptr, nullptr, 0, 0, legacy_format_);
   }
   return nullptr;
 }
 
-void Archive::Algorithm::read(Stream* stream) {
+template <size_t kInputs, bool kUseSSE, bool kMixer16 = false, size_t kNumMixers = 1>
+static uint64_t trialCompress(const std::vector<uint8_t>& sample, size_t mem_usage, bool lzp_enabled,
+                              Detector::Profile profile, const cm::CMProfileSet* profile_set, uint64_t* model_mask) {
+  cm::CM<kInputs, kUseSSE, kMixer16, kNumMixers> comp(FrequencyCounter<256>(), mem_usage, lzp_enabled, profile);
+  comp.SetProfileSet(profile_set);
+  ReadMemoryStream rms(&sample);
+  VoidWriteStream out;
+  comp.compress(&rms, &out, sample.size());
+  *model_mask = comp.ModelMask();
+  return out.tell();
+}
+
+void Archive::Algorithm::selectModels(const std::vector<uint8_t>& sample) {
+  if (!isCMLevel(algorithm_) || sample.empty()) {
+    return;
+  }
+  const size_t mem_usage = std::min(static_cast<size_t>(mem_usage_), kModelTrialMemUsage);
+  uint64_t best_size = std::numeric_limits<uint64_t>::max();
+  // Largest model set first, stop at the first smaller set which is not within the tolerance.
+  for (auto level = std::find(std::begin(kCMLevels), std::end(kCMLevels), algorithm_) + 1;
+       level != std::begin(kCMLevels);) {
+    const Compressor::Type type = *--level;
+    uint64_t mask = 0;
+    uint64_t size = 0;
+    switch (type) {
+    case Compressor::kTypeCMTurbo: size = trialCompress<3, false>(sample, mem_usage, lzp_enabled_, profile_, profile_set_.get(), &mask); break;
+    case Compressor::kTypeCMFast: size = trialCompress<4, false>(sample, mem_usage, lzp_enabled_, profile_, profile_set_.get(), &mask); break;
+    case Compressor::kTypeCMMid: size = trialCompress<6, false>(sample, mem_usage, lzp_enabled_, profile_, profile_set_.get(), &mask); break;
+    case Compressor::kTypeCMHigh: size = trialCompress<10, false>(sample, mem_usage, lzp_enabled_, profile_, profile_set_.get(), &mask); break;
+    case Compressor::kTypeCMMax: size = trialCompress<13, true>(sample, mem_usage, lzp_enabled_, profile_, profile_set_.get(), &mask); break;
+    case Compressor::kTypeCMUltra: size = trialCompress<13, true, true, 3>(sample, mem_usage, lzp_enabled_, profile_, profile_set_.get(), &mask); break;
+    }
+    best_size = std::min(best_size, size);
+    if (size > best_size + static_cast<uint64_t>(best_size * kModelTrialTolerance)) {
+      break;
+    }
+    algorithm_ = type;
+    model_mask_ = mask;
+  }
+  mixer16_ = mixer16_ && (algorithm_ == Compressor::kTypeCMHigh || algorithm_ == Compressor::kTypeCMMax);
+}
+
+void Archive::Algorithm::selectFilter(const std::vector<uint8_t>& sample, uint64_t block_size,
+                                      Analyzer* analyzer, Archive& archive) {
+  if (!isCMLevel(algorithm_) || prime_hash_ != 0 || sample.empty()) {
+    return;
+  }
+  const size_t mem_usage = std::min(static_cast<size_t>(mem_usage_), kModelTrialMemUsage);
+  // The profile default first so that it wins ties.
+  std::vector<FilterType> candidates;
+  for (FilterType candidate : { filter_, kFilterTypeNone, kFilterTypeLZP }) {
+    if (std::find(candidates.begin(), candidates.end(), candidate) == candidates.end()) {
+      candidates.push_back(candidate);
+    }
+  }
+  FilterType best_filter = filter_;
+  uint64_t best_size = std::numeric_limits<uint64_t>::max();
+  for (FilterType candidate : candidates) {
+    filter_ = candidate;
+    // The output for an empty input is the per block overhead (e.g. the dictionary), it does not
+    // scale with the block size.
+    uint64_t sizes[2];
+    for (size_t i = 0; i < 2; ++i) {
+      std::vector<uint8_t> in;
+      if (i == 1) in = sample;
+      ReadMemoryStream rms(&in);
+      std::unique_ptr<Filter> filter(createFilter(&rms, analyzer, archive));
+      Stream* in_stream = filter != nullptr ? static_cast<Stream*>(filter.get()) : &rms;
+      std::vector<uint8_t> filtered;
+      for (int c; (c = in_stream->get()) != EOF;) {
+        filtered.push_back(static_cast<uint8_t>(c));
+      }
+      uint64_t mask = 0;
+      sizes[i] = filtered.empty() ? 0 :
+        trialCompress<3, false>(filtered, mem_usage, lzp_enabled_, profile_, profile_set_.get(), &mask);
+    }
+    const uint64_t overhead = std::min(sizes[0], sizes[1]);
+    const uint64_t size = overhead + (sizes[1] - overhead) * block_size / sample.size();
+    if (size < best_size) {
+      best_size = size;
+      best_filter = candidate;
+    }
+  }
+  filter_ = best_filter;
+}
+
+void Archive::Algorithm::read(Stream* stream, uint32_t version) {
   mem_usage_ = static_cast<uint8_t>(stream->get());
   algorithm_ = static_cast<Compressor::Type>(stream->get());
   lzp_enabled_ = stream->get() != 0;
   filter_ = static_cast<FilterType>(stream->get());
   profile_ = static_cast<Detector::Profile>(stream->get());
+  profile_set_.reset();
+  prime_.reset();
+  legacy_format_ = version < Header::makeVersion(0, 85);
+  if (legacy_format_) {
+    // 0.84 blocks use the defaults.
+    model_mask_ = 0;
+    mixer16_ = false;
+    coder_ = kCoderTypeRange7;
+    huffman_ = false;
+    run_bypass_ = false;
+    long_match_ = false;
+    prime_hash_ = 0;
+    return;
+  }
+  model_mask_ = stream->leb128Decode();
+  mixer16_ = stream->get() != 0;
+  coder_ = static_cast<CoderType>(stream->get());
+  huffman_ = stream->get() != 0;
+  run_bypass_ = stream->get() != 0;
+  long_match_ = stream->get() != 0;
+  if (stream->get() != 0) {
+    profile_set_ = std::make_shared<cm::CMProfileSet>();
+    profile_set_->Read(stream);
+  }
+  prime_hash_ = stream->leb128Decode();
 }
 
 void Archive::Algorithm::write(Stream* stream) {
@@ -141,6 +411,17 @@ void Archive::Algorithm::write(Stream* stream) {
   stream->put(lzp_enabled_);
   stream->put(filter_);
   stream->put(profile_);
+  stream->leb128Encode(model_mask_);
+  stream->put(mixer16_);
+  stream->put(coder_);
+  stream->put(huffman_);
+  stream->put(run_bypass_);
+  stream->put(long_match_);
+  stream->put(profile_set_ != nullptr);
+  if (profile_set_ != nullptr) {
+    profile_set_->Write(stream);
+  }
+  stream->leb128Encode(prime_hash_);
 }
 
 std::ostream& operator<<(std::ostream& os, CompLevel comp_level) {
@@ -151,6 +432,7 @@ std::ostream& operator<<(std::ostream& os, CompLevel comp_level) {
   case kCompLevelMid: return os << "mid";
   case kCompLevelHigh: return os << "high";
   case kCompLevelMax: return os << "max";
+  case kCompLevelUltra: return os << "ultra";
   case kCompLevelSimple: return os << "simple";
   }
   return os << "unknown";
@@ -226,7 +508,7 @@ Filter* Archive::Algorithm::createFilter(Stream* stream, Analyzer* analyzer, Arc
           fout << s.Word() << std::endl;
         }
       }
-      auto& freq = builder.FrequencyCounter();
+      auto freq = builder.FrequencyCounter();
       dict_filter->AddCodeWords(code_words.GetCodeWords(), code_words.num1_, code_words.num2_, code_words.num3_, &freq, dict_codes.Count());
       if (false) {
         std::cerr << std::endl << "Before " << freq.Sum() << std::endl;
@@ -250,6 +532,17 @@ Filter* Archive::Algorithm::createFilter(Stream* stream, Analyzer* analyzer, Arc
   case kFilterTypeX86:
     ret = new X86AdvancedFilter(stream);
     break;
+  case kFilterTypeLZP:
+    ret = new LZPFilter(stream);
+    break;
+  case kFilterTypeNone:
+    break;
+  case kFilterTypeAuto:
+  case kFilterTypeTrial:
+  case kFilterTypeCount:
+    // Options only, the block gets a concrete filter before it is written.
+    check(false);
+    break;
   }
   if (ret != nullptr) {
     ret->setOpt(opt_var);
@@ -261,11 +554,13 @@ void Archive::constructBlocks(Analyzer::Blocks* blocks_for_file) {
 
 }
 
-Compressor* Archive::createMetaDataCompressor() {
+Compressor* Archive::createMetaDataCompressor(bool legacy_format) {
   if (kIsDebugBuild) {
     return new Store;
   }
-  return new cm::CM<6, false>(FrequencyCounter<256>(), 6, true, Detector::kProfileText);
+  auto* ret = new cm::CM<6, false>(FrequencyCounter<256>(), 6, true, Detector::kProfileText);
+  ret->SetLegacyFormat(legacy_format);
+  return ret;
 }
 
 void Archive::writeBlocks() {
@@ -294,9 +589,9 @@ void Archive::readBlocks() {
     return;
   }
   auto metadata_size = stream_->leb128Decode();
-  std::cout << "Metadata size=" << metadata_size << std::endl;
   // Decompress overhead.
-  std::unique_ptr<Compressor> c(createMetaDataCompressor());
+  std::unique_ptr<Compressor> c(
+    createMetaDataCompressor(header_.version() < Header::makeVersion(0, 85)));
   std::vector<uint8_t> metadata;
   WriteVectorStream wvs(&metadata);
   auto start_pos = stream_->tell();
@@ -304,7 +599,7 @@ void Archive::readBlocks() {
   auto cmp = stream_->leb128Decode();
   check(cmp == 1234u);
   ReadMemoryStream rms(&metadata);
-  blocks_.read(&rms);
+  blocks_.read(&rms, header_.version());
   files_.read(&rms);
 }
 
@@ -315,13 +610,13 @@ void Archive::Blocks::write(Stream* stream) {
   }
 }
 
-void Archive::Blocks::read(Stream* stream) {
+void Archive::Blocks::read(Stream* stream, uint32_t version) {
   size_t num_blocks = stream->leb128Decode();
   check(num_blocks < 1000000);  // Sanity check.
   clear();
   for (size_t i = 0; i < num_blocks; ++i) {
     std::unique_ptr<SolidBlock> block(new SolidBlock);
-    block->read(stream);
+    block->read(stream, version);
     push_back(std::move(block));
   }
 }
@@ -334,8 +629,8 @@ void Archive::SolidBlock::write(Stream* stream) {
   }
 }
 
-void Archive::SolidBlock::read(Stream* stream) {
-  algorithm_.read(stream);
+void Archive::SolidBlock::read(Stream* stream, uint32_t version) {
+  algorithm_.read(stream, version);
   size_t num_segments = stream->leb128Decode();
   check(num_segments < 10000000);
   segments_.resize(num_segments);
@@ -349,8 +644,9 @@ void Archive::SolidBlock::read(Stream* stream) {
 
 class FileSegmentStreamFileList : public FileSegmentStream {
 public:
-  FileSegmentStreamFileList(std::vector<FileSegments>* segments, uint64_t count, FileList* file_list, bool extract, bool verify)
-    : FileSegmentStream(segments, count), file_list_(file_list), extract_(extract), verify_(verify) {}
+  FileSegmentStreamFileList(std::vector<FileSegments>* segments, uint64_t count, FileList* file_list, bool extract, bool verify,
+                            const std::vector<std::vector<uint8_t>>* file_cache = nullptr)
+    : FileSegmentStream(segments, count), file_list_(file_list), extract_(extract), verify_(verify), file_cache_(file_cache) {}
   ~FileSegmentStreamFileList() {
       // Open remaining streams if zero sized?
     if (extract_ && !verify_) {
@@ -369,6 +665,9 @@ public:
       delete cur_stream_;
       cur_stream_ = nullptr;
     }
+    if (!extract_ && file_cache_ != nullptr && index < file_cache_->size() && !file_cache_->at(index).empty()) {
+      return new ReadMemoryStream(&file_cache_->at(index));
+    }
     // Open the new file.
     std::unique_ptr<File> ret(new File);
     auto& file_info = file_list_->at(index);
@@ -394,6 +693,7 @@ private:
   FileList* const file_list_;
   const bool extract_;
   const bool verify_;
+  const std::vector<std::vector<uint8_t>>* const file_cache_;
 };
 
 class VerifyFileSegmentStreamFileList : public FileSegmentStream {
@@ -709,6 +1009,9 @@ uint64_t Archive::compress(const std::vector<FileInfo>& in_files) {
     blocks_.push_back(std::unique_ptr<SolidBlock>(new SolidBlock(a)));
   }
   Analyzer analyzer;
+  if (options_.dict_phrases_) {
+    analyzer.getDictBuilder().EnablePhrases();
+  }
   {
     // Analyze enumerated and construct blocks.
     analyzer.setOpt(opt_var_);
@@ -716,6 +1019,9 @@ uint64_t Archive::compress(const std::vector<FileInfo>& in_files) {
     std::cout << "Analyzing " << files_.size() << " files" << std::endl;
     size_t file_idx = 0;
     uint64_t total_size = 0;
+    uint64_t cache_used = 0;
+    file_cache_.clear();
+    file_cache_.resize(files_.size());
     AnalyzerProgressThread thr;
     for (auto& f : files_) {
       if (!f.isDir()) {
@@ -725,7 +1031,22 @@ uint64_t Archive::compress(const std::vector<FileInfo>& in_files) {
           std::cerr << "Error opening: " << f.getName() << " (" << errstr(err) << ")" << std::endl;
         }
         thr.setStream(&fin);
-        analyzer.analyze(&fin, file_idx);
+        const uint64_t length = fin.length();
+        Stream* in = &fin;
+        std::unique_ptr<ReadMemoryStream> cached;
+        if (length > 0 && cache_used + length <= options_.cache_size_) {
+          auto& data = file_cache_[file_idx];
+          data.resize(static_cast<size_t>(length));
+          data.resize(fin.read(&data[0], data.size()));
+          cache_used += data.size();
+          cached.reset(new ReadMemoryStream(&data));
+          in = cached.get();
+        }
+        if (!options_.sample_analysis_ || length < Analyzer::kMinSampledLength ||
+            !analyzer.analyzeSampled(in, length, file_idx)) {
+          in->seek(0);
+          analyzer.analyze(in, file_idx);
+        }
         auto& blocks = analyzer.getBlocks();
         if (blocks.empty()) {
           blocks.push_back(Detector::DetectedBlock());
@@ -770,6 +1091,38 @@ uint64_t Archive::compress(const std::vector<FileInfo>& in_files) {
     const std::unique_ptr<SolidBlock>& b) {
     return a->total_size_ < b->total_size_;
   });
+  if (options_.filter_type_ == kFilterTypeTrial) {
+    // The filter is part of the block headers and changes the input of the model trial.
+    for (const auto& block : blocks_) {
+      if (block->total_size_ < kModelTrialMinBlockSize) {
+        continue;
+      }
+      FileSegmentStreamFileList segstream(&block->segments_, 0, &files_, false, false, &file_cache_);
+      std::vector<uint8_t> sample;
+      sample.reserve(kModelTrialSampleSize);
+      for (int c; sample.size() < kModelTrialSampleSize && (c = segstream.get()) != EOF;) {
+        sample.push_back(static_cast<uint8_t>(c));
+      }
+      block->algorithm_.selectFilter(sample, block->total_size_, &analyzer, *this);
+    }
+  }
+  if (options_.auto_models_) {
+    // The algorithm is part of the block headers, select the models before writing them.
+    for (const auto& block : blocks_) {
+      if (block->total_size_ < kModelTrialMinBlockSize) {
+        continue;
+      }
+      FileSegmentStreamFileList segstream(&block->segments_, 0, &files_, false, false, &file_cache_);
+      std::unique_ptr<Filter> filter(block->algorithm_.createFilter(&segstream, &analyzer, *this, opt_var_));
+      Stream* in_stream = filter != nullptr ? static_cast<Stream*>(filter.get()) : &segstream;
+      std::vector<uint8_t> sample;
+      sample.reserve(kModelTrialSampleSize);
+      for (int c; sample.size() < kModelTrialSampleSize && (c = in_stream->get()) != EOF;) {
+        sample.push_back(static_cast<uint8_t>(c));
+      }
+      block->algorithm_.selectModels(sample);
+    }
+  }
   writeBlocks();
   uint64_t total = 0;
   for (const auto& block : blocks_) {
@@ -777,7 +1130,7 @@ uint64_t Archive::compress(const std::vector<FileInfo>& in_files) {
     auto start = clock();
     auto out_start = stream_->tell();
     for (size_t i = 0; i < kSizePad; ++i) stream_->put(0);
-    FileSegmentStreamFileList segstream(&block->segments_, 0, &files_, false, false);
+    FileSegmentStreamFileList segstream(&block->segments_, 0, &files_, false, false, &file_cache_);
     Algorithm* algo = &block->algorithm_;
     std::cout << "Compressing " << Detector::profileToString(algo->profile())
       << " block size=" << formatNumber(block->total_size_) << "\t" << std::endl;
@@ -789,7 +1142,7 @@ uint64_t Archive::compress(const std::vector<FileInfo>& in_files) {
       freq = filter->GetFrequencies();
     }
     auto in_start = in_stream->tell();
-    std::unique_ptr<Compressor> comp(algo->CreateCompressor(freq));
+    std::unique_ptr<Compressor> comp(algo->CreateCompressor(freq, block->total_size_));
     if (!comp->setOpt(opt_var_)) return 0;
     if (!comp->setOpts(opt_vars_)) return 0;
     {
@@ -812,12 +1165,43 @@ uint64_t Archive::compress(const std::vector<FileInfo>& in_files) {
     total += block->total_size_;
   }
   files_.clear();
+  file_cache_.clear();
   return total;
 }
 
 // Decompress.
-void Archive::decompress(const std::string& out_dir, bool verify) {
+void Archive::decompressBlock(SolidBlock* block, Stream* out_stream, bool progress) {
+  // Read size.
+  auto out_start = stream_->tell();
+  auto block_size = stream_->leb128Decode();
+  while (stream_->tell() < out_start + kSizePad) {
+    stream_->get();
+  }
+  Algorithm* algo = &block->algorithm_;
+  Stream* filter_out_stream = out_stream;
+  std::unique_ptr<Filter> filter(algo->createFilter(filter_out_stream, nullptr, *this));
+  FrequencyCounter<256> freq;
+  if (filter != nullptr) {
+    filter_out_stream = filter.get();
+    freq = filter->GetFrequencies();
+  }
+  std::unique_ptr<Compressor> comp(algo->CreateCompressor(freq, block->total_size_));
+  comp->setOpt(opt_var_);
+  comp->setOpts(opt_vars_);
+  std::unique_ptr<ProgressThread> thr(progress ? new ProgressThread(out_stream, stream_, false, out_start) : nullptr);
+  comp->decompress(stream_, filter_out_stream, block_size);
+  if (filter.get() != nullptr) filter->flush();
+}
+
+bool Archive::decompress(const std::string& out_dir, bool verify) {
   readBlocks();
+  // Check the prime data before any output file gets created.
+  for (const auto& block : blocks_) {
+    if (!block->algorithm_.SetPrime(options_.prime_)) {
+      std::cerr << "Block was compressed with other prime data, pass it with -prime=" << std::endl;
+      return false;
+    }
+  }
   for (auto& f : files_) {
     f.setPrefix(&out_dir);
     if (f.isDir()) {
@@ -842,13 +1226,7 @@ void Archive::decompress(const std::string& out_dir, bool verify) {
       block->total_size_ += seg.total_size_;
     }
 
-    // Read size.
     auto out_start = stream_->tell();
-    auto block_size = stream_->leb128Decode();
-    while (stream_->tell() < out_start + kSizePad) {
-      stream_->get();
-    }
-
     auto start = clock();
     FileSegmentStreamFileList segstream(&block->segments_, 0u, &files_, true, verify);
     VerifyFileSegmentStreamFileList verify_segstream(&block->segments_, &files_, &remain_bytes);
@@ -857,29 +1235,17 @@ void Archive::decompress(const std::string& out_dir, bool verify) {
     std::cout << "Decompressing " << Detector::profileToString(algo->profile())
       << " stream size=" << formatNumber(block->total_size_) << "\t" << std::endl;
     Stream* out_stream = verify ? static_cast<Stream*>(&verify_segstream) : static_cast<Stream*>(&segstream);
-    Stream* filter_out_stream = out_stream;
-    std::unique_ptr<Filter> filter(algo->createFilter(filter_out_stream, nullptr, *this));
-    FrequencyCounter<256> freq;
-    if (filter != nullptr) {
-      filter_out_stream = filter.get();
-      freq = filter->GetFrequencies();
-    }
-    std::unique_ptr<Compressor> comp(algo->CreateCompressor(freq));
-    comp->setOpt(opt_var_);
-    comp->setOpts(opt_vars_);
-    {
-      ProgressThread thr(out_stream, stream_, false, out_start);
-      comp->decompress(stream_, filter_out_stream, block_size);
-      if (filter.get() != nullptr) filter->flush();
-    }
+    decompressBlock(block.get(), out_stream, true);
     differences += verify_segstream.totalDifferences();
     std::cout << std::endl << "Decompressed " << formatNumber(out_stream->tell()) << " <- " << formatNumber(stream_->tell() - out_start)
       << " in " << clockToSeconds(clock() - start) << "s" << std::endl << std::endl;
   }
   if (verify) {
+    bool missed = false;
     for (size_t i = 0; i < files_.size(); ++i) {
       if (remain_bytes[i] > 0) {
         std::cerr << "Missed writing " << remain_bytes[i] << " bytes to " << files_[i].getFullName() << std::endl;
+        missed = true;
       }
     }
     if (differences) {
@@ -887,7 +1253,9 @@ void Archive::decompress(const std::string& out_dir, bool verify) {
     } else {
       std::cout << "No differences found" << std::endl;
     }
+    return !missed && differences == 0;
   }
+  return true;
 }
 
 void Archive::list() {
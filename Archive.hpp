@@ -37,7 +37,10 @@ enum FilterType {
   kFilterTypeNone,
   kFilterTypeDict,
   kFilterTypeX86,
+  kFilterTypeLZP,
   kFilterTypeAuto,
+  // Not stored, picks one of the above per block from a trial compression.
+  kFilterTypeTrial,
   kFilterTypeCount,
 };
 
@@ -48,6 +51,7 @@ enum CompLevel {
   kCompLevelMid,
   kCompLevelHigh,
   kCompLevelMax,
+  kCompLevelUltra,
   kCompLevelSimple,
 };
 std::ostream& operator<<(std::ostream& os, CompLevel comp_level);
@@ -58,18 +62,90 @@ enum LZPType {
   kLZPTypeDisable,
 };
 
+// Binary arithmetic coder used by the CM levels.
+enum CoderType {
+  kCoderTypeAuto,
+  kCoderTypeRange7,
+  kCoderTypeRange64,
+};
+
+// Training data which the CM levels replay before a block so that small inputs start with warm
+// models. Built with the train command, the decoder needs the same data.
+class PrimeData {
+public:
+  static const size_t kMaxSize = 256 * KB;
+  // Replaying costs about as much as compressing the data, so a block only replays the tail of the
+  // data in proportion to its own size. Small blocks get a warm model without paying for all of it.
+  static const size_t kMinReplaySize = 32 * KB;
+  static const size_t kReplayRatio = 4;
+
+  // Takes whole files until kMaxSize, spread over the list if they don't all fit.
+  void Train(const FileList& files);
+  bool Load(const std::string& file_name, std::ostream& err);
+  bool Save(const std::string& file_name) const;
+  // Identifies the data in the block headers, never 0.
+  uint64_t Hash() const;
+
+  const std::vector<uint8_t>& Data() const {
+    return data_;
+  }
+  // How many bytes from the end of the data a block of block_size replays.
+  size_t ReplaySize(uint64_t block_size) const {
+    const uint64_t replay = std::max(static_cast<uint64_t>(kMinReplaySize), block_size * kReplayRatio);
+    return static_cast<size_t>(std::min(static_cast<uint64_t>(data_.size()), replay));
+  }
+
+private:
+  static const char* getMagic() {
+    return "MCMPRIME";
+  }
+  static const size_t kMagicStringLength = 8;
+  std::vector<uint8_t> data_;
+};
+
 class CompressionOptions {
 public:
   static const size_t kDefaultMemUsage = 6;
   static const CompLevel kDefaultLevel = kCompLevelMid;
   static const FilterType kDefaultFilter = kFilterTypeAuto;
   static const LZPType kDefaultLZPType = kLZPTypeAuto;
+  static const bool kDefaultAutoModels = false;
+  static const bool kDefaultMixer16 = false;
+  static const CoderType kDefaultCoderType = kCoderTypeAuto;
+  static const bool kDefaultHuffman = false;
+  static const bool kDefaultRunBypass = true;
+  static const bool kDefaultLongMatch = true;
+  static const bool kDefaultSampleAnalysis = false;
+  static const uint64_t kDefaultCacheSize = 0;
+  static const bool kDefaultDictPhrases = false;
 
 public:
   size_t mem_usage_ = kDefaultMemUsage;
   CompLevel comp_level_ = kDefaultLevel;
   FilterType filter_type_ = kDefaultFilter;
   LZPType lzp_type_ = kDefaultLZPType;
+  // Pick the model set per block from trial compressions of a sample.
+  bool auto_models_ = kDefaultAutoModels;
+  // Use the 16 bit weight mixers for the high and max levels.
+  bool mixer16_ = kDefaultMixer16;
+  CoderType coder_type_ = kDefaultCoderType;
+  // Code bytes as huffman codes in the CM levels when the filter knows the byte frequencies.
+  bool huffman_ = kDefaultHuffman;
+  // Code long runs of the same byte with a run model instead of per byte CM.
+  bool run_bypass_ = kDefaultRunBypass;
+  // Match model for repeats further back than the CM history, for the high, max and ultra levels.
+  bool long_match_ = kDefaultLongMatch;
+  // Classify large files from samples instead of reading them twice.
+  bool sample_analysis_ = kDefaultSampleAnalysis;
+  // Files read during analysis are kept in memory up to this many bytes, compression reads them
+  // from there instead of the disk.
+  uint64_t cache_size_ = kDefaultCacheSize;
+  // Add frequent multi word phrases from a sample of the text to the dictionary.
+  bool dict_phrases_ = kDefaultDictPhrases;
+  // CM profiles which replace the built in ones, loaded with -cm-profile=.
+  std::shared_ptr<cm::CMProfileSet> cm_profile_set_;
+  // Replayed through the CM levels before each block, loaded with -prime=.
+  std::shared_ptr<PrimeData> prime_;
   std::string dict_file_;
   std::string out_dict_file_;
 };
@@ -80,9 +156,17 @@ public:
   class Header {
   public:
     static const size_t kCurMajorVersion = 0;
-    static const size_t kCurMinorVersion = 84;
+    static const size_t kCurMinorVersion = 85;
+    // Oldest version that can be decompressed, newer block header fields get their defaults.
+    static const size_t kMinMajorVersion = 0;
+    static const size_t kMinMinorVersion = 84;
     static const size_t kMagicStringLength = 10;
 
+    // Comparable version number.
+    static uint32_t makeVersion(size_t major, size_t minor) {
+      return static_cast<uint32_t>((major << 16) | minor);
+    }
+
     static const char* getMagic() {
       return "MCMARCHIVE";
     }
@@ -90,7 +174,10 @@ public:
     void read(Stream* stream);
     void write(Stream* stream);
     bool isArchive() const;
-    bool isSameVersion() const;
+    bool isSupportedVersion() const;
+    uint32_t version() const {
+      return makeVersion(major_version_, minor_version_);
+    }
     uint16_t majorVersion() const {
       return major_version_;
     }
@@ -108,15 +195,25 @@ public:
   public:
     Algorithm() {}
     Algorithm(const CompressionOptions& options, Detector::Profile profile);
-    Algorithm(Stream* stream);
-    // Freq is the approximate distribution of input frequencies for the compressor.
-    Compressor* CreateCompressor(const FrequencyCounter<256>& freq);
-    void read(Stream* stream);
+    Algorithm(Stream* stream, uint32_t version);
+    // Freq is the approximate distribution of input frequencies for the compressor, block_size is
+    // the unfiltered size of the block.
+    Compressor* CreateCompressor(const FrequencyCounter<256>& freq, uint64_t block_size);
+    // Version is the archive version, fields which it doesn't have get their defaults.
+    void read(Stream* stream, uint32_t version);
     void write(Stream* stream);
     Filter* createFilter(Stream* stream, Analyzer* analyzer, Archive& archive, size_t opt_var = 0);
+    // Trial compress the sample with the CM levels up to the current one and keep the
+    // smallest model set which is within the tolerance of the best.
+    void selectModels(const std::vector<uint8_t>& sample);
+    // Trial compress the unfiltered sample through each candidate filter and keep the one with the
+    // smallest size estimated for the whole block.
+    void selectFilter(const std::vector<uint8_t>& sample, uint64_t block_size, Analyzer* analyzer, Archive& archive);
     Detector::Profile profile() const {
       return profile_;
     }
+    // Give the block the prime data it was compressed with, false if it doesn't match.
+    bool SetPrime(const std::shared_ptr<PrimeData>& prime);
 
   private:
     uint8_t mem_usage_;
@@ -124,6 +221,25 @@ public:
     bool lzp_enabled_;
     FilterType filter_;
     Detector::Profile profile_;
+    // Enabled CM models, 0 for the defaults of the algorithm.
+    uint64_t model_mask_ = 0;
+    // 16 bit weight mixers, only for CMHigh and CMMax.
+    bool mixer16_ = false;
+    // Arithmetic coder of the CM levels, never auto.
+    CoderType coder_ = kCoderTypeRange7;
+    // Huffman coded bytes, the CM stream says whether the tree was actually used.
+    bool huffman_ = false;
+    // Long runs of the same byte are coded with the CM run model.
+    bool run_bypass_ = false;
+    // Long range match model, only for CMHigh, CMMax and CMUltra.
+    bool long_match_ = false;
+    // Replaces the built in CM profiles if not null.
+    std::shared_ptr<cm::CMProfileSet> profile_set_;
+    // Hash of the prime data, 0 if not primed.
+    uint64_t prime_hash_ = 0;
+    std::shared_ptr<PrimeData> prime_;
+    // Read from a 0.84 archive, the CM stream uses the old hashes. Not stored.
+    bool legacy_format_ = false;
   };
 
   class SolidBlock {
@@ -136,13 +252,13 @@ public:
     SolidBlock() = default;
     SolidBlock(const Algorithm& algorithm) : algorithm_(algorithm) {}
     void write(Stream* stream);
-    void read(Stream* stream);
+    void read(Stream* stream, uint32_t version);
   };
 
   class Blocks : public std::vector<std::unique_ptr<SolidBlock>> {
   public:
     void write(Stream* stream);
-    void read(Stream* stream);
+    void read(Stream* stream, uint32_t version);
   };
 
   // Compression.
@@ -158,6 +274,10 @@ public:
     return header_;
   }
 
+  Blocks& getBlocks() {
+    return blocks_;
+  }
+
   CompressionOptions& Options() {
     return options_;
   }
@@ -179,8 +299,11 @@ public:
   // Analyze and compress. Returns how many bytes wre compressed.
   uint64_t compress(const std::vector<FileInfo>& in_files);
 
-  // Decompress.
-  void decompress(const std::string& out_dir, bool verify = false);
+  // Decompress, returns false if the archive can't be decompressed (or verified).
+  bool decompress(const std::string& out_dir, bool verify = false);
+
+  // Decompress the block at the current archive position to out, readBlocks must be called first.
+  void decompressBlock(SolidBlock* block, Stream* out_stream, bool progress = false);
 
   // List files and info.
   void list();
@@ -193,9 +316,11 @@ private:
   size_t opt_var_;  
   FileList files_;  // File list.
   Blocks blocks_;  // Solid blocks.
+  // Contents of the files cached during analysis by file index, empty if not cached.
+  std::vector<std::vector<uint8_t>> file_cache_;
 
   void init();
-  Compressor* createMetaDataCompressor();
+  Compressor* createMetaDataCompressor(bool legacy_format = false);
 };
 
 #endif
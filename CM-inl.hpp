@@ -25,8 +25,8 @@
 
 namespace cm {
 
-template <size_t kInputs, bool kUseSSE, typename HistoryType>
-inline void CM<kInputs, kUseSSE, HistoryType>::init() {
+template <size_t kInputs, bool kUseSSE, bool kMixer16, size_t kNumMixers, typename Coder, typename HistoryType>
+inline void CM<kInputs, kUseSSE, kMixer16, kNumMixers, Coder, HistoryType>::init() {
   const auto start = clock();
   // Simple model.
   {
@@ -130,7 +130,7 @@ inline void CM<kInputs, kUseSSE, HistoryType>::init() {
     // binary_profile_ = CMProfile();
     binary_profile_.SetMatchModelOrder(binary_mm_order);
     binary_profile_.SetMinLZPLen(lzp_enabled_ ? 0 : kMaxMatch + 1);
-    binary_profile_.SetMissFastPath(25000);
+    binary_profile_.SetMissFastPath(legacy_format_ ? kLegacyMissFastPath : kBinaryMissFastPath);
   }
   {
     // Binary model for match.
@@ -153,15 +153,19 @@ inline void CM<kInputs, kUseSSE, HistoryType>::init() {
   }
   current_interval_map_ = binary_interval_map_;
 
-  table_.build(opts_);
-
   const size_t extra_mixer_bits = 4 + mem_level_;
   // const size_t extra_mixer_bits = std::min(opt_var_, static_cast<size_t>(4u)) + mem_level_;
   const size_t mixer_bits = kMixerBits;
   const size_t mixer_shift_bits = (kMixerBits - 15);
   mixers_[0].Init(0x100 << extra_mixer_bits, mixer_bits, 25);
+  if (kNumMixers > 1) {
+    mixers_[1].Init(0x100 * 0x100, mixer_bits, 25);
+    mix2_.Init(0x100, kMix2Bits);
+  }
+  if (kNumMixers > 2) {
+    mixers_[2].Init(0x100 * (kMaxMatchMixerLen + 1), mixer_bits, 25);
+  }
 
-  std::cout << std::endl;
   for (auto& m : mixers_) {
     // std::cout << "Mixers " << m.Size() << " RAM=" << m.Size() * sizeof(CMMixer) << " bytes" << std::endl;
   }
@@ -212,11 +216,11 @@ inline void CM<kInputs, kUseSSE, HistoryType>::init() {
     mixer_binary_learn_[kModelInterval2] = 6 + tl[9];
   }
 #endif
+  if (has_profile_set_) {
+    ApplyProfileSet(profile_set_);
+  }
   for (auto& s : mixer_skip_) s = 0;
 
-  NSStateMap<kShift> sm;
-  sm.build(nullptr);
-
   sse_.init(257 * 256, &table_);
   sse2_.init(257 * 256, &table_);
   sse3_.init(257 * 256, &table_);
@@ -233,6 +237,16 @@ inline void CM<kInputs, kUseSSE, HistoryType>::init() {
   // Match model.
   match_model_.resize(buffer_.Size() >> 1);
   match_model_.init(MatchModelType::kMinMatch, 80U);
+  use_long_match_ = long_match_block_size_ > buffer_.Size();
+  if (use_long_match_) {
+    size_t window = buffer_.Size() << kLongMatchWindowShift;
+    while (window / 2 >= long_match_block_size_) {
+      window /= 2;
+    }
+    long_match_model_.resize(window, window >> (kLongMatchWindowShift + 2));
+    long_match_model_.init();
+  }
+  long_match_ = false;
   fixed_match_probs_.resize(81U * 2);
   int magic_array[100];
   for (size_t i = 1; i < 100; ++i) magic_array[i] = (kMaxValue / 2) / i;
@@ -247,29 +261,19 @@ inline void CM<kInputs, kUseSSE, HistoryType>::init() {
   }
 
   const bool kUseReorder = true;
-  uint8_t binary_reorder[] = { 38,2,3,4,5,15,6,23,7,8,9,10,12,13,14,11,17,18,19,16,20,21,24,22,1,25,26,27,28,29,30,31,33,34,35,36,40,37,39,32,42,41,43,44,45,46,47,64,55,49,54,50,48,51,52,53,56,57,58,59,60,61,62,63,84,65,67,66,68,69,70,71,72,73,74,75,76,77,78,79,80,81,82,83,85,86,87,88,89,90,93,94,95,91,92,96,97,98,99,100,101,116,102,103,104,105,106,107,108,109,110,111,112,113,114,115,117,118,119,121,120,122,123,124,125,126,127,128,129,130,131,143,132,133,134,135,136,137,138,139,140,141,142,144,152,145,146,147,148,149,150,151,153,155,154,156,0,157,158,159,160,161,162,163,164,165,166,167,168,169,170,171,172,175,173,174,176,177,178,179,180,181,182,183,184,185,186,187,188,189,190,191,195,192,193,194,196,197,198,199,200,201,202,203,204,205,206,207,208,209,210,211,212,213,214,215,216,217,218,219,220,221,222,223,224,225,226,227,228,229,230,231,232,233,234,235,236,237,238,239,240,241,242,243,244,245,246,247,248,249,250,251,252,253,254,255, };
-  uint8_t text_reorder[] = { 7,14,1,12,3,4,11,15,9,16,5,6,18,13,19,30,45,20,21,22,23,17,8,2,26,10,32,43,36,35,42,29,34,24,25,37,31,33,39,38,0,41,28,40,44,58,46,59,92,27,60,61,91,63,95,47,64,124,94,62,93,96,123,125,72,69,65,67,83,68,66,73,82,70,80,76,71,81,77,87,78,74,79,84,75,48,49,50,51,52,53,54,55,56,57,86,88,97,98,99,100,85,101,90,103,104,89,105,107,102,108,109,110,111,106,113,112,114,115,116,119,118,120,121,117,122,126,127,128,129,130,131,132,133,134,135,136,137,138,139,140,141,142,143,151,144,145,146,147,148,149,150,152,153,155,156,157,154,158,159,160,161,162,163,164,165,166,167,168,169,170,171,172,173,174,175,176,177,178,179,180,181,182,183,184,185,186,187,188,189,190,191,192,193,194,195,196,197,198,199,200,201,202,203,204,205,206,207,208,209,210,211,212,213,214,215,216,217,218,219,220,221,222,223,224,225,226,239,227,228,229,230,231,232,233,234,235,236,237,238,240,241,242,243,244,245,246,247,248,249,250,251,252,253,254,255, };
+  static const uint8_t binary_reorder[] = { 38,2,3,4,5,15,6,23,7,8,9,10,12,13,14,11,17,18,19,16,20,21,24,22,1,25,26,27,28,29,30,31,33,34,35,36,40,37,39,32,42,41,43,44,45,46,47,64,55,49,54,50,48,51,52,53,56,57,58,59,60,61,62,63,84,65,67,66,68,69,70,71,72,73,74,75,76,77,78,79,80,81,82,83,85,86,87,88,89,90,93,94,95,91,92,96,97,98,99,100,101,116,102,103,104,105,106,107,108,109,110,111,112,113,114,115,117,118,119,121,120,122,123,124,125,126,127,128,129,130,131,143,132,133,134,135,136,137,138,139,140,141,142,144,152,145,146,147,148,149,150,151,153,155,154,156,0,157,158,159,160,161,162,163,164,165,166,167,168,169,170,171,172,175,173,174,176,177,178,179,180,181,182,183,184,185,186,187,188,189,190,191,195,192,193,194,196,197,198,199,200,201,202,203,204,205,206,207,208,209,210,211,212,213,214,215,216,217,218,219,220,221,222,223,224,225,226,227,228,229,230,231,232,233,234,235,236,237,238,239,240,241,242,243,244,245,246,247,248,249,250,251,252,253,254,255, };
+  static const uint8_t text_reorder[] = { 7,14,1,12,3,4,11,15,9,16,5,6,18,13,19,30,45,20,21,22,23,17,8,2,26,10,32,43,36,35,42,29,34,24,25,37,31,33,39,38,0,41,28,40,44,58,46,59,92,27,60,61,91,63,95,47,64,124,94,62,93,96,123,125,72,69,65,67,83,68,66,73,82,70,80,76,71,81,77,87,78,74,79,84,75,48,49,50,51,52,53,54,55,56,57,86,88,97,98,99,100,85,101,90,103,104,89,105,107,102,108,109,110,111,106,113,112,114,115,116,119,118,120,121,117,122,126,127,128,129,130,131,132,133,134,135,136,137,138,139,140,141,142,143,151,144,145,146,147,148,149,150,152,153,155,156,157,154,158,159,160,161,162,163,164,165,166,167,168,169,170,171,172,173,174,175,176,177,178,179,180,181,182,183,184,185,186,187,188,189,190,191,192,193,194,195,196,197,198,199,200,201,202,203,204,205,206,207,208,209,210,211,212,213,214,215,216,217,218,219,220,221,222,223,224,225,226,239,227,228,229,230,231,232,233,234,235,236,237,238,240,241,242,243,244,245,246,247,248,249,250,251,252,253,254,255, };
 
   for (int i = 0; i < 256; ++i) {
     // if (opts_) text_reorder[i] = opts_[i];
     text_reorder_[i] = kUseReorder ? text_reorder[i] : i;
     binary_reorder_[i] = kUseReorder ? binary_reorder[i] : i;
   }
-  uint8_t binary_mask_map[] = { 15,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,6,12,12,12,12,12,13,12,12,12,12,12,12,12,12,12,12,12,12,12,12,10,12,12,12,12,12,12,12,12,12,12,12,12,12,9,9,9,12,9,9,9,9,9,9,9,12,9,9,9,9,9,9,9,12,9,9,9,12,9,9,9,12,9,9,9,12,7,7,8,12,7,11,7,7,7,14,7,12,7,7,7,12,7,7,7,7,7,7,7,12,7,7,7,12,7,7,7,1,5,5,14,5,5,5,5,5,4,5,3,1,2,5,5,1,5,1,1,1,5,5,5,1,1,1,1,1,1,1,1,1,7,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,5,1,1,10,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,7,1,1,10,10,1,1,1,1,1,1,0,1,1,1,1,1,1,1,1,0, };
-  uint8_t small_text_mask[] = { 7,7,7,1,4,7,3,7,7,6,7,6,6,6,6,3,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,4,6,5,5,0,2,5,7,2,5,5,7,5,4,3,3,3,3,3,3,3,3,3,3,3,3,5,7,4,1,4,0,2,2,2,2,2,2,2,2,2,2,0,2,2,2,2,2,2,2,2,2,2,2,2,1,2,2,2,2,2,2,5,6,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,7,7,7,5,7,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, };
-  uint8_t text_mask[] = { 15,0,0,2,15,0,8,3,2,12,13,1,3,0,7,9,12,0,0,0,0,0,0,2,0,6,0,0,9,0,0,0,12,7,14,9,7,11,4,11,10,4,9,14,9,8,7,6,5,5,5,5,5,5,5,5,5,5,14,9,2,15,13,4,2,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,2,4,4,4,4,4,4,5,4,4,3,3,10,1,3,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,1,1,4,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, };
-  uint8_t text_mask2[] = { 4,2,0,7,2,0,13,0,0,5,4,0,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,0,11,2,10,8,5,6,3,9,14,7,7,3,1,5,15,10,0,0,0,0,0,0,0,0,0,0,1,13,13,8,7,7,14,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,3,15,6,12,14,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,12,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, };
+  static const uint8_t binary_mask_map[] = { 15,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,6,12,12,12,12,12,13,12,12,12,12,12,12,12,12,12,12,12,12,12,12,10,12,12,12,12,12,12,12,12,12,12,12,12,12,9,9,9,12,9,9,9,9,9,9,9,12,9,9,9,9,9,9,9,12,9,9,9,12,9,9,9,12,9,9,9,12,7,7,8,12,7,11,7,7,7,14,7,12,7,7,7,12,7,7,7,7,7,7,7,12,7,7,7,12,7,7,7,1,5,5,14,5,5,5,5,5,4,5,3,1,2,5,5,1,5,1,1,1,5,5,5,1,1,1,1,1,1,1,1,1,7,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,5,1,1,10,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,7,1,1,10,10,1,1,1,1,1,1,0,1,1,1,1,1,1,1,1,0, };
+  static const uint8_t small_text_mask[] = { 7,7,7,1,4,7,3,7,7,6,7,6,6,6,6,3,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,4,6,5,5,0,2,5,7,2,5,5,7,5,4,3,3,3,3,3,3,3,3,3,3,3,3,5,7,4,1,4,0,2,2,2,2,2,2,2,2,2,2,0,2,2,2,2,2,2,2,2,2,2,2,2,1,2,2,2,2,2,2,5,6,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,7,7,7,5,7,0,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, };
+  static const uint8_t text_mask[] = { 15,0,0,2,15,0,8,3,2,12,13,1,3,0,7,9,12,0,0,0,0,0,0,2,0,6,0,0,9,0,0,0,12,7,14,9,7,11,4,11,10,4,9,14,9,8,7,6,5,5,5,5,5,5,5,5,5,5,14,9,2,15,13,4,2,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,2,4,4,4,4,4,4,5,4,4,3,3,10,1,3,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,1,1,4,2,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, };
+  static const uint8_t text_mask2[] = { 4,2,0,7,2,0,13,0,0,5,4,0,3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,0,11,2,10,8,5,6,3,9,14,7,7,3,1,5,15,10,0,0,0,0,0,0,0,0,0,0,1,13,13,8,7,7,14,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,3,15,6,12,14,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,12,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, };
   reorder_.Copy(text_reorder_);
-  if (true) {
-    std::ofstream of("of.txt");
-    for (size_t i = 0; i < 256; ++i) of << (size_t)reorder_.Backward(i) << ",";
-    of << std::endl;
-    for (size_t i = 0; i < 256; ++i) {
-      int c = reorder_.Backward(i);
-      of << i << " " << static_cast<int>(small_text_mask[c]) << "," << static_cast<int>(text_mask[c]) << " '";
-      of << (isspace(c) ? ' ' : static_cast<char>(c)) << "' ascii=" << (size_t)c << std::endl;
-    }
-  }
   for (size_t i = 0; i < 256; ++i) {
     // if (opts_) small_text_mask[i] = opts_[i];
     int ri = reorder_[i];
@@ -304,13 +308,10 @@ inline void CM<kInputs, kUseSSE, HistoryType>::init() {
   }
 
   // Optimization
-  for (uint32_t i = 0; i < kNumStates; ++i) {
-    for (uint32_t j = 0; j < 2; ++j) {
-      state_trans_[i][j] = sm.getTransition(i, j);
-    }
-  }
+  static const StateTransitions shared_state_trans;
+  std::copy(&shared_state_trans.next_[0][0], &shared_state_trans.next_[0][0] + kNumStates * 2, &state_trans_[0][0]);
 
-  unsigned short initial_probs[][256] = {
+  static const unsigned short initial_probs[][256] = {
     {1895,1286,725,499,357,303,156,155,154,117,107,117,98,66,125,64,51,107,78,74,66,68,47,61,56,61,77,46,43,59,40,41,28,22,37,42,37,33,25,29,40,42,26,47,64,31,39,0,0,1,19,6,20,1058,391,195,265,194,240,132,107,125,151,113,110,91,90,95,56,105,300,22,831,997,1248,719,1194,159,156,1381,689,581,476,400,403,388,372,360,377,1802,626,740,664,1708,1141,1012,973,780,883,713,1816,1381,1621,1528,1865,2123,2456,2201,2565,2822,3017,2301,1766,1681,1472,1082,983,2585,1504,1909,2058,2844,1611,1349,2973,3084,2293,3283,2350,1689,3093,2502,1759,3351,2638,3395,3450,3430,3552,3374,3536,3560,2203,1412,3112,3591,3673,3588,1939,1529,2819,3655,3643,3731,3764,2350,3943,2640,3962,2619,3166,2244,1949,2579,2873,1683,2512,1876,3197,3712,1678,3099,3020,3308,1671,2608,1843,3487,3465,2304,3384,3577,3689,3671,3691,1861,3809,2346,1243,3790,3868,2764,2330,3795,3850,3864,3903,3933,3963,3818,3720,3908,3899,1950,3964,3924,3954,3960,4091,2509,4089,2512,4087,2783,2073,4084,2656,2455,3104,2222,3683,2815,3304,2268,1759,2878,3295,3253,2094,2254,2267,2303,3201,3013,1860,2471,2396,2311,3345,3731,3705,3709,2179,3580,3350,2332,4009,3996,3989,4032,4007,4023,2937,4008,4095,2048,},
     {2065,1488,826,573,462,381,254,263,197,158,175,57,107,95,95,104,89,69,76,86,83,61,44,64,49,53,63,46,80,29,57,28,55,35,41,33,43,42,37,57,20,35,53,25,11,10,29,16,16,9,27,15,17,1459,370,266,306,333,253,202,152,115,151,212,135,142,148,128,93,102,810,80,1314,2025,2116,846,2617,189,195,1539,775,651,586,526,456,419,400,335,407,2075,710,678,810,1889,1219,1059,891,785,933,859,2125,1325,1680,1445,1761,2054,2635,2366,2499,2835,2996,2167,1536,1676,1342,1198,874,2695,1548,2002,2400,2904,1517,1281,2981,3177,2402,3366,2235,1535,3171,2282,1681,3201,2525,3405,3438,3542,3535,3510,3501,3514,2019,1518,3151,3598,3618,3597,1904,1542,2903,3630,3655,3671,3761,2054,3895,2512,3935,2451,3159,2323,2223,2722,3020,2033,2557,2441,3333,3707,1993,3154,3352,3576,2153,2849,1992,3625,3629,2459,3643,3703,3703,3769,3753,2274,3860,2421,1565,3859,3877,2580,2061,3781,3807,3864,3931,3907,3924,3807,3835,3852,3910,2197,3903,3946,3962,3975,4068,2662,4062,2662,4052,2696,2080,4067,2645,2424,2010,2325,3186,1931,2033,2514,831,2116,2060,2148,1988,1528,1034,938,2016,1837,1916,1512,1536,1553,2036,2841,2827,3000,2444,2571,2151,2078,4067,4067,4063,4079,4077,4075,3493,4081,4095,2048,},
     {1910,1427,670,442,319,253,222,167,183,142,117,119,118,95,82,50,88,92,71,57,53,56,58,52,58,57,32,47,71,37,37,44,42,43,30,25,22,44,16,21,28,64,15,53,27,24,24,12,7,41,28,8,11,1377,414,343,397,329,276,233,200,190,194,230,178,161,157,133,122,110,1006,139,1270,1940,1896,871,2411,215,255,1637,860,576,586,531,573,407,465,353,320,2027,693,759,830,1964,1163,1078,919,923,944,703,2011,1305,1743,1554,1819,2005,2562,2213,2577,2828,2864,2184,1509,1725,1389,1359,1029,2409,1423,2011,2221,2769,1406,1234,2842,3177,2267,3392,2201,1607,3069,2339,1684,3275,2443,3346,3431,3444,3558,3382,3482,3425,1811,1558,3048,3603,3603,3486,1724,1504,2796,3632,3716,3647,3709,2010,3928,2231,3865,2188,3083,2329,2202,2520,2953,2157,2497,2367,3480,3727,1990,3121,3313,3536,2251,2838,2068,3694,3517,2316,3656,3637,3679,3800,3674,2215,3807,2371,1565,3879,3785,2440,2056,3853,3849,3850,3931,3946,3955,3807,3819,3902,3926,2196,3906,3978,3947,3964,4058,2636,4050,2637,4071,2692,2176,4063,2627,2233,1749,2178,2683,1561,1526,2220,947,1973,1801,1902,1652,1434,843,675,1630,1784,1890,1413,1368,1618,1703,2574,2651,2421,2088,2120,1785,2026,4055,4057,4069,4063,4082,4070,3234,4062,4094,2048,},
@@ -342,7 +343,21 @@ inline void CM<kInputs, kUseSSE, HistoryType>::init() {
   }
   SetDataProfile(data_profile_);
   last_bytes_ = 0;
+  run_len_ = 0;
+  // Runs usually continue.
+  for (auto& m : run_models_) m.init(kMaxValue - kMaxValue / 64);
+  last_bytes2_ = 0;
   SetUpCtxState();
+  use_huffman_ = false;
+  miss_len_ = 0;
+  byte_cost_ = 0;
+  full_cost_ = (8 * 256) << kCostAvgShift;
+  // Start pessimistic so that the fast path has to prove itself through probes first.
+  fast_cost_ = (9 * 256) << kCostAvgShift;
+  fast_entry_cost_ = fast_cost_;
+  mode_bytes_ = 0;
+  fast_run_ = kFastPathMinRun;
+  fast_mode_ = false;
   // Statistics
   if (kStatistics) {
     for (auto& c : mixer_skip_) c = 0;
@@ -351,51 +366,45 @@ inline void CM<kInputs, kUseSSE, HistoryType>::init() {
     lzp_bit_match_bytes_ = lzp_bit_miss_bytes_ = lzp_miss_bytes_ = normal_bytes_ = 0;
     for (auto& len : match_hits_) len = 0;
     for (auto& len : match_miss_) len = 0;
-    miss_len_ = 0;
     for (auto& c : miss_count_) c = 0;
     fast_bytes_ = 0;
   }
 }
 
-template <size_t kInputs, bool kUseSSE, typename HistoryType>
-inline void CM<kInputs, kUseSSE, HistoryType>::compress(Stream* in_stream, Stream* out_stream, uint64_t max_count) {
+template <size_t kInputs, bool kUseSSE, bool kMixer16, size_t kNumMixers, typename Coder, typename HistoryType>
+inline void CM<kInputs, kUseSSE, kMixer16, kNumMixers, Coder, HistoryType>::compress(Stream* in_stream, Stream* out_stream, uint64_t max_count) {
   BufferedStreamWriter<4 * KB> sout(out_stream);
   BufferedStreamReader<4 * KB> sin(in_stream);
   assert(in_stream != nullptr);
   assert(out_stream != nullptr);
-  Detector detector(in_stream);
-  if (!force_profile_) {
-    detector.setOptVar(opt_var_);
-    detector.init();
-  }
   init();
-  ent = Range7();
-  if (use_huffman) {
-    const clock_t start = clock();
-    size_t freqs[256] = { 1 };
-    std::cout << "Building huffman tree" << std::endl;
-    Huffman::HuffTree* tree = Huffman::Tree<uint32_t>::BuildPackageMerge(freqs, 256, huffman_len_limit);
-    tree->PrintRatio(std::cout, "LL");
-    Huffman::writeTree(ent, sout, tree, 256, huffman_len_limit);
-    huff.build(tree);
-    std::cout << "Building huffman tree took: " << clock() - start << " MS" << std::endl;
+  Prime();
+  if (huffman_enabled_) {
+    // The tree is over the reordered bytes of the initial profile.
+    FrequencyCounter<256> freq;
+    for (size_t i = 0; i < 256; ++i) {
+      freq.Add(reorder_[i], frequencies_.GetFrequencies()[i]);
+    }
+    use_huffman_ = freq.Sum() != 0;
+    ent.EncodeBits(sout, use_huffman_, 1);
+    if (use_huffman_) {
+      std::unique_ptr<Huffman::HuffTree> tree(
+        Huffman::HuffTree::BuildPackageMerge(freq.GetFrequencies(), 256, huffman_len_limit));
+      check(tree != nullptr);
+      tree->PrintRatio(std::cout, "bytes");
+      Huffman::writeTree(ent, sout, tree.get(), 256, huffman_len_limit);
+      SetUpHuffman(tree.get());
+    }
   }
   for (;max_count > 0; --max_count) {
-    uint32_t c;
-    if (!force_profile_) {
-      Detector::Profile new_profile;
-      c = detector.get(new_profile);
-      if (new_profile == Detector::kProfileEOF) break;
-      auto data_profile = profileForDetectorProfile(new_profile);
-      if (data_profile != data_profile_) {
-        SetDataProfile(data_profile);
-      }
-    } else {
-      c = sin.get();
-      if (c == EOF) break;
-    }
+    uint32_t c = sin.get();
+    if (c == EOF) break;
     c = reorder_[c];
     dcheck(c != EOF);
+    if (InRun() && ProcessRun<false>(sout, &c)) {
+      UpdateRun(c);
+      continue;
+    }
     processByte<false>(sout, c);
     update(c);
   }
@@ -463,9 +472,6 @@ inline void CM<kInputs, kUseSSE, HistoryType>::compress(Stream* in_stream, Strea
       }
       std::cout << "zero=" << z << " nonzero=" << nz << std::endl;
     }
-    if (!force_profile_) {
-      detector.dumpInfo();
-    }
     std::cout << "CMed bytes=" << formatNumber((mixer_skip_[0] + mixer_skip_[1]) / 8)
       << " mix skip=" << formatNumber(mixer_skip_[0])
       << " mix nonskip=" << formatNumber(mixer_skip_[1]) << std::endl;
@@ -496,43 +502,49 @@ inline void CM<kInputs, kUseSSE, HistoryType>::compress(Stream* in_stream, Strea
   }
 }
 
-template <size_t kInputs, bool kUseSSE, typename HistoryType>
-inline void CM<kInputs, kUseSSE, HistoryType>::decompress(Stream* in_stream, Stream* out_stream, uint64_t max_count) {
+template <size_t kInputs, bool kUseSSE, bool kMixer16, size_t kNumMixers, typename Coder, typename HistoryType>
+inline void CM<kInputs, kUseSSE, kMixer16, kNumMixers, Coder, HistoryType>::Prime() {
+  if (prime_data_ != nullptr) {
+    // Code the data into the void so that the tables and mixers adapt the same way on both sides.
+    VoidWriteStream void_stream;
+    BufferedStreamWriter<4 * KB> sout(&void_stream);
+    ent = Coder();
+    for (auto it = prime_data_->end() - prime_size_; it != prime_data_->end(); ++it) {
+      uint32_t c = reorder_[*it];
+      if (InRun() && ProcessRun<false>(sout, &c)) {
+        UpdateRun(c);
+        continue;
+      }
+      processByte<false>(sout, c);
+      update(c);
+    }
+  }
+  ent = Coder();
+}
+
+template <size_t kInputs, bool kUseSSE, bool kMixer16, size_t kNumMixers, typename Coder, typename HistoryType>
+inline void CM<kInputs, kUseSSE, kMixer16, kNumMixers, Coder, HistoryType>::decompress(Stream* in_stream, Stream* out_stream, uint64_t max_count) {
   BufferedStreamReader<4 * KB> sin(in_stream);
   BufferedStreamWriter<4 * KB> sout(out_stream);
-  Detector detector(out_stream);
-  if (!force_profile_) {
-    detector.setOptVar(opt_var_);
-    detector.init();
-  }
   init();
+  Prime();
   ent.initDecoder(sin);
-  if (use_huffman) {
-    // auto* tree = Huffman::readTree(ent, sin, 256, huffman_len_limit);
-    // huff.build(tree);
-    // delete tree;
+  if (huffman_enabled_) {
+    use_huffman_ = ent.DecodeDirectBits(sin, 1) != 0;
+    if (use_huffman_) {
+      std::unique_ptr<Huffman::HuffTree> tree(Huffman::readTree(ent, sin, 256, huffman_len_limit));
+      SetUpHuffman(tree.get());
+    }
   }
   for (; max_count > 0; --max_count) {
-    if (!force_profile_) {
-      auto new_profile = detector.detect();
-      if (new_profile == Detector::kProfileEOF) {
-        break;
-      }
-      auto cm_profile = profileForDetectorProfile(new_profile);
-      if (cm_profile != data_profile_) {
-        SetDataProfile(cm_profile);
-      }
-    }
-    size_t c = processByte<true>(sin);
-    update(c);
-    if (force_profile_) {
-      sout.put(reorder_.Backward(c));
+    uint32_t c;
+    if (InRun() && ProcessRun<true>(sin, &c)) {
+      UpdateRun(c);
     } else {
-      detector.put(reorder_.Backward(c));
+      c = processByte<true>(sin);
+      update(c);
     }
-  }
-  if (!force_profile_) {
-    detector.flush();
+    sout.put(reorder_.Backward(c));
   }
   sout.flush();
   size_t remain = sin.remain();
@@ -542,53 +554,72 @@ inline void CM<kInputs, kUseSSE, HistoryType>::decompress(Stream* in_stream, Str
   }
 }
 
-template <size_t kInputs, bool kUseSSE, typename HistoryType>
-inline CM<kInputs, kUseSSE, HistoryType>::CM(
+template <size_t kInputs, bool kUseSSE, bool kMixer16, size_t kNumMixers, typename Coder, typename HistoryType>
+inline CM<kInputs, kUseSSE, kMixer16, kNumMixers, Coder, HistoryType>::CM(
   const FrequencyCounter<256>& freq,
   uint32_t mem_level,
   bool lzp_enabled,
   Detector::Profile profile)
-  : mem_level_(mem_level)
+  : table_(SSTable::Shared())
+  , cost_table_(CostTable::Shared())
+  , mem_level_(mem_level)
   , data_profile_(profileForDetectorProfile(profile)) {
-  force_profile_ = profile != Detector::kProfileDetect;
   lzp_enabled_ = lzp_enabled;
   opts_ = dummy_opts;
   frequencies_ = freq;
 }
 
 // Context map for each context.
-template <size_t kInputs, bool kUseSSE, typename HistoryType>
-inline void CM<kInputs, kUseSSE, HistoryType>::SetStates(const uint32_t* remap) {
+template <size_t kInputs, bool kUseSSE, bool kMixer16, size_t kNumMixers, typename Coder, typename HistoryType>
+inline void CM<kInputs, kUseSSE, kMixer16, kNumMixers, Coder, HistoryType>::SetStates(ByteState* state, const uint32_t* remap) {
   bool reached[256] = {};
   size_t count = 0;
   for (size_t bits = 0; bits < 255; ++bits) {
     const auto idx = remap[bits];
     for (size_t bit = 0; bit < 2; ++bit) {
       const size_t next_bits = bits * 2 + bit + 1;
-      ctx_state_.SetBits(idx, bits);
+      state->SetBits(idx, bits);
       if (next_bits < 256) {
         check(reached[next_bits] == false);
         reached[next_bits] = true;
         ++count;
-        ctx_state_.SetNext(idx, bit, remap[next_bits]);
+        state->SetNext(idx, bit, remap[next_bits]);
       } else {
-        ctx_state_.SetNext(idx, bit, next_bits ^ 0x100);
+        state->SetNext(idx, bit, next_bits ^ 0x100);
       }
     }
     size_t top_bit = bits + 1;
     while ((top_bit & (top_bit - 1)) != 0) {
       --top_bit;
     }
-    ctx_state_.SetBits(idx, (bits + 1) ^ top_bit);
+    state->SetBits(idx, (bits + 1) ^ top_bit);
   }
 }
   
-template <size_t kInputs, bool kUseSSE, typename HistoryType>
-inline void CM<kInputs, kUseSSE, HistoryType>::SetUpCtxState() {
+template <size_t kInputs, bool kUseSSE, bool kMixer16, size_t kNumMixers, typename Coder, typename HistoryType>
+inline void CM<kInputs, kUseSSE, kMixer16, kNumMixers, Coder, HistoryType>::SetUpCtxState() {
   if (false) {
     OptimalCtxState();
     return;
   }
+  // The nibble layout does not depend on the data, only build it once.
+  static const ByteState shared_ctx_state = BuildCtxState();
+  ctx_state_ = shared_ctx_state;
+}
+
+template <size_t kInputs, bool kUseSSE, bool kMixer16, size_t kNumMixers, typename Coder, typename HistoryType>
+inline void CM<kInputs, kUseSSE, kMixer16, kNumMixers, Coder, HistoryType>::SetUpHuffman(const Huffman::HuffTree* tree) {
+  huff.build(tree);
+  // A full tree over 256 symbols has 255 internal nodes, the same number of states as the byte tree.
+  for (uint32_t state = 0; state < 255; ++state) {
+    for (uint32_t bit = 0; bit < 2; ++bit) {
+      ctx_state_.SetNext(state, bit, huff.getTransition(state, bit));
+    }
+  }
+}
+
+template <size_t kInputs, bool kUseSSE, bool kMixer16, size_t kNumMixers, typename Coder, typename HistoryType>
+inline typename CM<kInputs, kUseSSE, kMixer16, kNumMixers, Coder, HistoryType>::ByteState CM<kInputs, kUseSSE, kMixer16, kNumMixers, Coder, HistoryType>::BuildCtxState() {
   uint32_t bits[256] = {256};
   uint32_t ctx_map[256] = {};
   bits[0] = 0;
@@ -605,11 +636,13 @@ inline void CM<kInputs, kUseSSE, HistoryType>::SetUpCtxState() {
       }
     }
   }
-  SetStates(ctx_map);
+  ByteState state;
+  SetStates(&state, ctx_map);
+  return state;
 }
 
-template <size_t kInputs, bool kUseSSE, typename HistoryType>
-inline void CM<kInputs, kUseSSE, HistoryType>::OptimalCtxState() {
+template <size_t kInputs, bool kUseSSE, bool kMixer16, size_t kNumMixers, typename Coder, typename HistoryType>
+inline void CM<kInputs, kUseSSE, kMixer16, kNumMixers, Coder, HistoryType>::OptimalCtxState() {
   int64_t cost[256] = {};
   // Fill in corresponding
   // byte = (node * 2 + bit + 2) ^ 256
@@ -678,7 +711,7 @@ inline void CM<kInputs, kUseSSE, HistoryType>::OptimalCtxState() {
       ctx_map[i] = cur_ctx++;
     }
   }
-  SetStates(ctx_map);
+  SetStates(&ctx_state_, ctx_map);
 }
 
 }
@@ -84,8 +84,9 @@ namespace cm {
   };
 
   class CMProfile {
-    static constexpr size_t kMaxOrder = 12;
   public:
+    static constexpr size_t kMaxOrder = 12;
+
     ALWAYS_INLINE bool ModelEnabled(ModelType model, ModelType*& out) const {
       bool enabled = ModelEnabled(model);
       if (enabled && out != nullptr) *(out++) = model;
@@ -100,6 +101,15 @@ namespace cm {
       CalculateMaxOrder();
     }
 
+    uint64_t EnabledModels() const {
+      return enabled_models_;
+    }
+
+    void SetEnabledModels(uint64_t models) {
+      enabled_models_ = models;
+      CalculateMaxOrder();
+    }
+
     template <typename T>
     void EnableModels(const T* models, size_t count) {
       for (size_t i = 0; i < count; ++i) {
@@ -150,6 +160,10 @@ namespace cm {
       return miss_fast_path_;
     }
 
+    bool HasMissFastPath() const {
+      return miss_fast_path_ != 0xFFFFFFFF;
+    }
+
     static CMProfile CreateSimple(size_t inputs, size_t min_lzp_len = 10) {
       CMProfile base;
       base.EnableModel(kModelOrder0);
@@ -168,6 +182,32 @@ namespace cm {
       return base;
     }
 
+    // Keep only the first count enabled models, the CM can not use more than kInputs.
+    void LimitModels(size_t count) {
+      uint64_t models = 0;
+      for (uint64_t remain = enabled_models_; remain != 0 && count != 0; --count) {
+        const uint64_t lowest = remain & (~remain + 1);
+        models |= lowest;
+        remain ^= lowest;
+      }
+      SetEnabledModels(models);
+    }
+
+    void Write(Stream* stream) const {
+      stream->leb128Encode(static_cast<uint64_t>(enabled_models_));
+      stream->leb128Encode(static_cast<uint64_t>(min_lzp_len_));
+      stream->leb128Encode(static_cast<uint64_t>(miss_fast_path_));
+      stream->leb128Encode(static_cast<uint64_t>(match_model_order_));
+    }
+
+    void Read(Stream* stream) {
+      enabled_models_ = stream->leb128Decode();
+      min_lzp_len_ = static_cast<size_t>(stream->leb128Decode());
+      miss_fast_path_ = static_cast<size_t>(stream->leb128Decode());
+      match_model_order_ = static_cast<size_t>(stream->leb128Decode());
+      CalculateMaxOrder();
+    }
+
   private:
     // Parameters.
     uint64_t enabled_models_ = 0;
@@ -180,6 +220,141 @@ namespace cm {
     size_t max_order_ = 0;
   };
 
+  // Profiles and mixer learn rates which replace the built in ones of the CM, stored in the archive
+  // header so that the decoder rebuilds the same. A profile with no models or a learn rate of 0
+  // keeps the built in value.
+  class CMProfileSet {
+  public:
+    CMProfile text_;
+    CMProfile text_match_;
+    CMProfile binary_;
+    CMProfile binary_match_;
+    uint8_t text_learn_[kModelCount] = {};
+    uint8_t binary_learn_[kModelCount] = {};
+
+    static const char* ModelName(ModelType model) {
+      static const char* const kNames[kModelCount] = {
+        "order0", "order1", "order2", "order3", "order4",
+        "order5", "order6", "order7", "order8", "order9",
+        "order10", "order11", "order12", "bracket", "sparse2",
+        "sparse3", "sparse4", "sparse23", "sparse34", "word1",
+        "word2", "word12", "interval", "interval2", "interval3", "specialchar",
+      };
+      return kNames[static_cast<size_t>(model)];
+    }
+
+    static bool ParseModel(const std::string& name, ModelType* out) {
+      for (size_t i = 0; i < kModelCount; ++i) {
+        if (name == ModelName(static_cast<ModelType>(i))) {
+          *out = static_cast<ModelType>(i);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void Write(Stream* stream) const {
+      text_.Write(stream);
+      text_match_.Write(stream);
+      binary_.Write(stream);
+      binary_match_.Write(stream);
+      stream->leb128Encode(static_cast<uint64_t>(kModelCount));
+      for (size_t i = 0; i < kModelCount; ++i) {
+        stream->put(text_learn_[i]);
+        stream->put(binary_learn_[i]);
+      }
+    }
+
+    void Read(Stream* stream) {
+      text_.Read(stream);
+      text_match_.Read(stream);
+      binary_.Read(stream);
+      binary_match_.Read(stream);
+      const size_t count = static_cast<size_t>(stream->leb128Decode());
+      for (size_t i = 0; i < count; ++i) {
+        const uint8_t text_learn = static_cast<uint8_t>(stream->get());
+        const uint8_t binary_learn = static_cast<uint8_t>(stream->get());
+        if (i < kModelCount) {
+          text_learn_[i] = text_learn;
+          binary_learn_[i] = binary_learn;
+        }
+      }
+    }
+
+    // Text format, one profile per line, # starts a comment:
+    // text|text_match|binary|binary_match models=order1,order2,... match_order=7 min_lzp_len=12 miss_fast_path=32
+    // text_learn|binary_learn order0=24 word1=20 ...
+    // Keys left out of a profile line mean disabled, a match_order of 0 has no match model.
+    bool Load(const std::string& file_name, std::ostream& err) {
+      std::ifstream fin(file_name.c_str());
+      if (!fin.good()) {
+        err << "Failed to open CM profile " << file_name << std::endl;
+        return false;
+      }
+      std::string line;
+      for (size_t line_num = 1; std::getline(fin, line); ++line_num) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream iss(line);
+        std::string name;
+        if (!(iss >> name)) {
+          continue;
+        }
+        CMProfile* profile = nullptr;
+        uint8_t* learn = nullptr;
+        if (name == "text") profile = &text_;
+        else if (name == "text_match") profile = &text_match_;
+        else if (name == "binary") profile = &binary_;
+        else if (name == "binary_match") profile = &binary_match_;
+        else if (name == "text_learn") learn = text_learn_;
+        else if (name == "binary_learn") learn = binary_learn_;
+        else {
+          err << file_name << ":" << line_num << ": unknown profile " << name << std::endl;
+          return false;
+        }
+        if (profile != nullptr) {
+          *profile = CMProfile();
+        }
+        for (std::string option; iss >> option;) {
+          const size_t eq = option.find('=');
+          const std::string key = option.substr(0, eq);
+          const std::string value = eq != std::string::npos ? option.substr(eq + 1) : "";
+          bool valid = !value.empty();
+          if (valid && profile != nullptr && key == "models") {
+            std::istringstream models(value);
+            for (std::string model_name; valid && std::getline(models, model_name, ',');) {
+              ModelType model;
+              valid = ParseModel(model_name, &model);
+              if (valid) profile->EnableModel(model);
+            }
+          } else if (valid) {
+            char* end = nullptr;
+            const unsigned long num = std::strtoul(value.c_str(), &end, 10);
+            ModelType model;
+            if (*end != '\0') {
+              valid = false;
+            } else if (profile == nullptr) {
+              valid = ParseModel(key, &model) && num > 0 && num < 256;
+              if (valid) learn[model] = static_cast<uint8_t>(num);
+            } else if (key == "match_order") {
+              profile->SetMatchModelOrder(num);
+            } else if (key == "min_lzp_len") {
+              profile->SetMinLZPLen(num);
+            } else if (key == "miss_fast_path") {
+              profile->SetMissFastPath(num);
+            } else {
+              valid = false;
+            }
+          }
+          if (!valid) {
+            err << file_name << ":" << line_num << ": invalid option " << option << std::endl;
+            return false;
+          }
+        }
+      }
+      return true;
+    }
+  };
+
   class ByteStateMap {
   public:
     ALWAYS_INLINE static bool IsLeaf(uint32_t state) {
@@ -213,7 +388,12 @@ namespace cm {
     void emplace(uint32_t e, uint32_t a, uint32_t b) {}
   };
 
-  template <size_t kInputs, bool kUseSSE, typename HistoryType = VoidHistoryWriter>
+  // kMixer16 selects the mixers with 16 bit weights, see Mixer16.
+  // kNumMixers > 1 mixes the inputs with several mixers selected by different contexts, their
+  // outputs are combined by a final mixer (mix2_).
+  // Coder is the binary arithmetic coder, Range7 or Range64.
+  template <size_t kInputs, bool kUseSSE, bool kMixer16 = false, size_t kNumMixers = 1,
+            typename Coder = Range7, typename HistoryType = VoidHistoryWriter>
   class CM : public Compressor {
   public:
     // Internal set of special profiles.
@@ -234,6 +414,9 @@ namespace cm {
     static const bool kUsePrefetch = true;
     static const bool kPrefetchMatchModel = true;
     static const bool kPrefetchWordModel = true;
+    // Decoder only, prefetch the slots of both possible second nibbles, see PrefetchChildren. Off since
+    // it measured slower.
+    static const bool kPrefetchChildren = false;
     static const bool kFixedMatchProbs = false;
 
     // SS table
@@ -242,7 +425,10 @@ namespace cm {
     static const int kMinST = -kMaxValue / 2;
     static const int kMaxST = kMaxValue / 2;
     typedef ss_table<short, kMaxValue, kMinST, kMaxST, 8> SSTable;
-    SSTable table_;
+    const SSTable& table_;
+    // Coding cost of a bit in 1/256 bits, drives the miss fast path selection.
+    typedef SymbolCostTable<kShift, 8> CostTable;
+    const CostTable& cost_table_;
 
     typedef safeBitModel<unsigned short, kShift, 5, 15> BitModel;
     typedef fastBitModel<int, kShift, 9, 30> StationaryModel;
@@ -260,12 +446,21 @@ namespace cm {
 
     FrequencyCounter<256> frequencies_;
 
-    Range7 ent;
+    Coder ent;
 
     typedef MatchModel<HPStationaryModel> MatchModelType;
     MatchModelType match_model_;
     std::vector<int> fixed_match_probs_;
 
+    // Long range matches are fed through match_model_ when it has no match of its own. The window
+    // is up to kLongMatchWindowShift times the history, only allocated for blocks which don't fit in
+    // the history.
+    static const size_t kLongMatchWindowShift = 4;
+    uint64_t long_match_block_size_ = 0;
+    bool use_long_match_ = false;
+    LongMatchModel long_match_model_;
+    bool long_match_ = false;
+
     // Hash table
     size_t hash_mask_;
     size_t hash_alloc_size_;
@@ -299,17 +494,20 @@ namespace cm {
     uint64_t interval2_mask_ = 0;
 
     // Mixers
-    typedef Mixer<int, kInputs> CMMixer;
-    static constexpr size_t kNumMixers = 1;
+    typedef typename std::conditional<kMixer16, Mixer16<kInputs>, Mixer<int, kInputs>>::type CMMixer;
+    static_assert(kNumMixers >= 1 && kNumMixers <= 3, "mixer contexts are defined for up to 3 mixers");
+    static constexpr size_t kMaxMatchMixerLen = 31;
     static constexpr size_t kMixerBits16 = 15;
     static constexpr size_t kMixerBits32 = 17;
-    static constexpr size_t kMixerBits = kMixerBits32;
+    static constexpr size_t kMixerBits = kMixer16 ? kMixerBits16 : kMixerBits32;
+    static_assert(kMixerBits32 - kMixerBits16 == Mixer16<kInputs>::kWeightShift, "mixer scales must match");
     MixerArray<CMMixer> mixers_[kNumMixers];
     size_t interval_mixer_mask_;
     uint8_t mixer_text_learn_[kModelCount];
     uint8_t mixer_binary_learn_[kModelCount];
 
-    // Stage 
+    // Final mixer, only used if kNumMixers > 1. Inputs are the outputs of the first layer.
+    static constexpr size_t kMix2Bits = 16;
     typedef Mixer<int, kNumMixers> CMMixer2;
     MixerArray<CMMixer2> mix2_;
     uint32_t mixer_match_ = 0;
@@ -318,6 +516,8 @@ namespace cm {
 
     // 8 recently seen bytes.
     uint64_t last_bytes_;
+    // The 8 bytes before last_bytes_.
+    uint64_t last_bytes2_;
 
     // Rotating buffer.
     CyclicBuffer<uint8_t> buffer_;
@@ -330,14 +530,32 @@ namespace cm {
     // CM state table.
     static const uint32_t kNumStates = 256;
     uint8_t state_trans_[kNumStates][2];
+    struct StateTransitions {
+      uint8_t next_[kNumStates][2];
+      StateTransitions() {
+        NSStateMap<kShift> sm;
+        for (uint32_t i = 0; i < kNumStates; ++i) {
+          for (uint32_t j = 0; j < 2; ++j) {
+            next_[i][j] = sm.getTransition(i, j);
+          }
+        }
+      }
+    };
 
-    // Huffman preprocessing.
-    static const bool use_huffman = false;
+    // Huffman preprocessing, bytes are coded as length limited huffman codes built from the filter
+    // frequencies instead of 8 bits. Only used if enabled and the frequencies are known.
+    bool huffman_enabled_ = false;
+    bool use_huffman_ = false;
     static const uint32_t huffman_len_limit = 16;
     Huffman huff;
 
-    // If force profile is true then we dont use a detector.
-    bool force_profile_;
+    // Run bypass, once the last kRunMinLen bytes are equal each byte first codes whether it
+    // continues the run with one adaptive bit instead of going through processByte.
+    static const size_t kRunMinLen = 32;
+    static const size_t kRunCtxCount = 32;
+    bool run_enabled_ = false;
+    size_t run_len_ = 0;
+    HPStationaryModel run_models_[kRunCtxCount];
 
     // CM profiles.
     CMProfile text_profile_;
@@ -349,6 +567,14 @@ namespace cm {
     // Current (active) profile.
     CMProfile cur_profile_;
     CMProfile cur_match_profile_;
+    uint64_t model_mask_ = 0;
+    bool has_profile_set_ = false;
+    CMProfileSet profile_set_;
+    // Bytes to run through the model before the block, not owned. Only the last prime_size_ get replayed.
+    const std::vector<uint8_t>* prime_data_ = nullptr;
+    size_t prime_size_ = 0;
+    // Code the stream like 0.84 did, chained order hashes and the fixed miss fast path.
+    bool legacy_format_ = false;
 
     // Interval model.
     uint64_t interval_model_ = 0;
@@ -410,6 +636,35 @@ namespace cm {
     uint64_t miss_count_[kMaxMiss];
     uint64_t fast_bytes_;
 
+    // Miss fast path selection. Both paths keep a moving average of their cost per byte (1/256 bits,
+    // scaled by 2^kCostAvgShift), computed from the coded bits so that the decoder makes the same
+    // choices. The full models are measured directly while they are active and the fast path is
+    // probed every kFastPathProbeInterval bytes. Full model probes from fast mode would see stale
+    // contexts, so fast mode is instead left when the data gets more compressible than it was on
+    // entry or after kFastPathMaxRun bytes, and the full models get kFullPathWarmup bytes to
+    // re-measure before the fast path may be picked again.
+    static const uint32_t kCostAvgShift = 8;
+    static const uint32_t kFastPathProbeInterval = 32;
+    // The fast path is only probed and picked when the full models spend at least 7.75 bits per
+    // byte, below that they win on all the compressed data tried so far.
+    static const uint32_t kFastPathMinCost = 31 * 64;
+    static const uint32_t kFastPathMinRun = 2 * KB;
+    static const uint32_t kFastPathMaxRun = 64 * KB;
+    static const uint32_t kFullPathWarmup = 1 * KB;
+    // Minimum run of match model misses before a binary block considers the fast path.
+    static const size_t kBinaryMissFastPath = 32;
+    // 0.84 archives took the fast path unconditionally after this many misses.
+    static const size_t kLegacyMissFastPath = 25000;
+    uint32_t byte_cost_;
+    uint32_t full_cost_;
+    uint32_t fast_cost_;
+    uint32_t fast_entry_cost_;
+    uint32_t mode_bytes_;
+    uint32_t fast_run_;
+    bool fast_mode_;
+    // Only profiles with a miss fast path compare costs, the others skip the per bit cost lookup.
+    bool track_miss_cost_ = false;
+
     size_t mem_level_ = 0;
 
     HistoryType* out_history_ = nullptr;
@@ -431,10 +686,12 @@ namespace cm {
       out_history_ = out_history;
     }
 
+    // The whole stream is coded with profile, the archive splits the input into blocks by profile
+    // when analyzing so there is no detection or in stream block header here.
     CM(const FrequencyCounter<256>& freq,
        uint32_t mem_level = 8,
        bool lzp_enabled = true,
-       Detector::Profile profile = Detector::kProfileDetect);
+       Detector::Profile profile = Detector::kProfileBinary);
 
     bool setOpt(uint32_t var) OVERRIDE {
       opt_var_ = var;
@@ -446,14 +703,109 @@ namespace cm {
     }
 
     virtual bool setOpts(size_t* opts) OVERRIDE {
-      opts_ = opts;
-      special_char_model_.SetOpts(opts);
-      bracket_.SetOpts(opts);
-      word_model_.SetOpts(opts);
+      opts_ = opts != nullptr ? opts : dummy_opts;
+      special_char_model_.SetOpts(opts_);
+      bracket_.SetOpts(opts_);
+      word_model_.SetOpts(opts_);
       return true;
     }
 
+    // Override the enabled models of the active profile, 0 means use the defaults for kInputs.
+    void SetModelMask(uint64_t mask) {
+      model_mask_ = mask;
+    }
+
+    uint64_t ModelMask() const {
+      return cur_profile_.EnabledModels();
+    }
+
+    // Code the bytes with a huffman code if the frequencies passed to the constructor are known.
+    void SetHuffman(bool enabled) {
+      huffman_enabled_ = enabled;
+    }
+
+    // Replace the built in profiles and learn rates, the set is copied.
+    void SetProfileSet(const CMProfileSet* profile_set) {
+      has_profile_set_ = profile_set != nullptr;
+      if (has_profile_set_) {
+        profile_set_ = *profile_set;
+      }
+    }
+
+    // Warm up the model with the last size bytes of a training snapshot, the decompressor needs the
+    // same data and size.
+    void SetPrimeData(const std::vector<uint8_t>* prime_data, size_t size) {
+      prime_data_ = prime_data;
+      prime_size_ = prime_data != nullptr ? std::min(size, prime_data->size()) : 0;
+    }
+
+    void ApplyProfileSet(const CMProfileSet& set) {
+      const std::pair<const CMProfile*, CMProfile*> profiles[] = {
+        { &set.text_, &text_profile_ },
+        { &set.text_match_, &text_match_profile_ },
+        { &set.binary_, &binary_profile_ },
+        { &set.binary_match_, &binary_match_profile_ },
+      };
+      for (const auto& p : profiles) {
+        if (p.first->EnabledModels() != 0) {
+          *p.second = *p.first;
+          p.second->LimitModels(kInputs);
+          if (!lzp_enabled_) {
+            p.second->SetMinLZPLen(kMaxMatch + 1);
+          }
+        }
+      }
+      for (size_t i = 0; i < kModelCount; ++i) {
+        if (set.text_learn_[i] != 0) mixer_text_learn_[i] = set.text_learn_[i];
+        if (set.binary_learn_[i] != 0) mixer_binary_learn_[i] = set.binary_learn_[i];
+      }
+    }
+
+    // Code long runs of the same byte with the run model.
+    void SetRunBypass(bool enabled) {
+      run_enabled_ = enabled;
+    }
+
+    // Decode blocks from 0.84 archives.
+    void SetLegacyFormat(bool enabled) {
+      legacy_format_ = enabled;
+    }
+
+    // Look for matches further back than the history, the window is sized for block_size bytes of
+    // input. Both sides must pass the same size, 0 disables it.
+    void SetLongMatch(uint64_t block_size) {
+      long_match_block_size_ = block_size;
+    }
+
+    ALWAYS_INLINE bool InRun() const {
+      return run_enabled_ && run_len_ >= kRunMinLen;
+    }
+
+    // Returns true if the byte continues the run, c is then the run byte.
+    template <const bool decode, typename TStream>
+    ALWAYS_INLINE bool ProcessRun(TStream& stream, uint32_t* c) {
+      auto& m = run_models_[std::min(static_cast<size_t>(bitSize(static_cast<uint32_t>(run_len_))), kRunCtxCount - 1)];
+      int p = m.getP();
+      p += p == 0;
+      p -= p == kMaxValue;
+      const uint32_t run_char = static_cast<uint8_t>(last_bytes_);
+      uint32_t bit;
+      if (decode) {
+        bit = ent.getDecodedBit(p, kShift);
+        ent.Normalize(stream);
+      } else {
+        bit = *c == run_char;
+        ent.encode(stream, bit, p, kShift);
+      }
+      m.update(bit);
+      if (bit != 0) {
+        *c = run_char;
+      }
+      return bit != 0;
+    }
+
     void init();
+    void Prime();
 
     ALWAYS_INLINE uint32_t HashFunc(uint64_t a, uint64_t b) const {
       b += a;
@@ -461,8 +813,39 @@ namespace cm {
       return b ^ (b >> 13);
     }
 
-    void SetStates(const uint32_t* remap);
+    // Hash of the last order bytes (up to kMaxOrder). Unlike chaining HashFunc one byte at a time,
+    // the hashes of different orders do not depend on each other and get computed in parallel.
+    ALWAYS_INLINE uint32_t OrderHash(size_t order) const {
+      static_assert(CMProfile::kMaxOrder <= 16, "history only has 16 bytes");
+      uint64_t w = last_bytes_;
+      uint64_t w2 = 0;
+      if (order < 8) {
+        w &= (static_cast<uint64_t>(1) << (order * 8)) - 1;
+      } else if (order > 8) {
+        w2 = last_bytes2_ & ((static_cast<uint64_t>(1) << ((order - 8) * 8)) - 1);
+      }
+      const uint64_t x = (w ^ (static_cast<uint64_t>(order) << 56)) * 0x9E3779B97F4A7C15ull + w2 * 0xC2B2AE3D27D4EB4Full;
+      return static_cast<uint32_t>(x >> 32);
+    }
+
+    // The 0.84 order hash, chains HashFunc over the bytes one at a time.
+    ALWAYS_INLINE uint32_t LegacyOrderHash(size_t order) const {
+      uint32_t h = HashFunc((last_bytes_ & 0xFFFF) * 3, 0x4ec457c1 * 19);
+      for (size_t i = 3; i <= order; ++i) {
+        h = HashFunc(buffer_[buffer_.Pos() - i], h);
+      }
+      return h;
+    }
+
+    ALWAYS_INLINE uint32_t MatchHash(size_t order) const {
+      return legacy_format_ ? LegacyOrderHash(order) : OrderHash(std::max(order, static_cast<size_t>(2)));
+    }
+
+    static void SetStates(ByteState* state, const uint32_t* remap);
+    static ByteState BuildCtxState();
     void SetUpCtxState();
+    // Use the states of the huffman tree instead of the nibble layout.
+    void SetUpHuffman(const Huffman::HuffTree* tree);
     void OptimalCtxState();
 
     void CalcMixerBase() {
@@ -486,6 +869,12 @@ namespace cm {
         mixer_ctx = (mixer_ctx << 1) | (mm_len > 0 || word_model_.getLength() > 6);
       }
       mixers_[0].SetContext(mixer_ctx << 8);
+      if (kNumMixers > 1) {
+        mixers_[1].SetContext((last_bytes_ & 0xFF) << 8);
+      }
+      if (kNumMixers > 2) {
+        mixers_[2].SetContext(std::min(static_cast<size_t>(mm_len), static_cast<size_t>(kMaxMatchMixerLen)) << 8);
+      }
     }
 
     ALWAYS_INLINE uint8_t NextState(uint32_t index, uint8_t state, size_t bit, uint32_t updater, uint32_t ctx, size_t update = 9) {
@@ -513,11 +902,31 @@ namespace cm {
       return hashify(model);
     }
 
+    // The next bit is only known after the arithmetic decoder, which leaves the loads of the next
+    // slots on the critical path. Slot = base ^ ctx, so the first nibble (ctx < 16) shares the cache
+    // line of the base that GetHashes prefetched and only the second nibble can move to another line.
+    // Prefetch the roots of both possible second nibbles while the last bit of the first one decodes.
+    ALWAYS_INLINE void PrefetchChildren(const size_t* base_contexts, size_t cur_ctx, size_t ctx_add) {
+      const size_t ctx0 = ctx_state_.Next(cur_ctx, 0) + ctx_add;
+      const size_t ctx1 = ctx_state_.Next(cur_ctx, 1) + ctx_add;
+      for (size_t i = 0; i < kInputs; ++i) {
+        Prefetch(&hash_table_[base_contexts[i] ^ ctx0]);
+        Prefetch(&hash_table_[base_contexts[i] ^ ctx1]);
+      }
+    }
+
 		template <const bool kDecode, BitType kBitType, size_t kBits, typename TStream>
 		size_t ProcessBits(TStream& stream, const size_t c, size_t* base_contexts, size_t ctx_add) {
 			uint32_t code = 0;
+      // Huffman codes end at a leaf of the code tree instead of after kBits.
+      const bool huffman = kBits == kBitsPerByte && use_huffman_;
 			if (!kDecode) {
-        code = c << (sizeof(uint32_t) * kBitsPerByte - kBits);
+        if (huffman) {
+          const auto& huff_code = huff.getCode(c);
+          code = huff_code.value << (sizeof(uint32_t) * kBitsPerByte - huff_code.length);
+        } else {
+          code = c << (sizeof(uint32_t) * kBitsPerByte - kBits);
+        }
 			}
       size_t base_ctx = 0;
       size_t cur_ctx = 0;
@@ -583,6 +992,9 @@ namespace cm {
 				if (kInputs > 13) s13 = *(sp13 = &ht[base_contexts[13] ^ ctx_xor]);
 				if (kInputs > 14) s14 = *(sp14 = &ht[base_contexts[14] ^ ctx_xor]);
 				if (kInputs > 15) s15 = *(sp15 = &ht[base_contexts[15] ^ ctx_xor]);
+				if (kDecode && kPrefetchChildren && kBits == kBitsPerByte && bits == 5 && !huffman) {
+					PrefetchChildren(base_contexts, cur_ctx, base_ctx + ctx_add);
+				}
 
 				if (kInputs > 1) p1 = GetSTP(s1, 1);
 				if (kInputs > 2) p2 = GetSTP(s2, 2);
@@ -599,10 +1011,23 @@ namespace cm {
 				if (kInputs > 13) p13 = GetSTP(s13, 13);
 				if (kInputs > 14) p14 = GetSTP(s14, 14);
 				if (kInputs > 15) p15 = GetSTP(s15, 15);
-				int m0p, m1p, m2p, stage2p;
-				CMMixer* m0 = mixers_[0].GetMixer() + mixer_ctx;
-				m0p = m0->P(kMixerBits, p0, p1, p2, p3, p4, p5, p6, p7, p8, p9, p10, p11, p12, p13, p14, p15);
-				int stp = m0p;
+				// The first layer mixers share the same inputs.
+				CMMixer* ms[kNumMixers];
+				int mps[4] = {};
+				for (size_t i = 0; i < kNumMixers; ++i) {
+					ms[i] = mixers_[i].GetMixer() + mixer_ctx;
+				}
+				MixerLayer<CMMixer, kNumMixers>::P(ms, kMixerBits, mps, p0, p1, p2, p3, p4, p5, p6, p7, p8, p9, p10, p11, p12, p13, p14, p15);
+				CMMixer* m0 = ms[0];
+				int stp = mps[0];
+				CMMixer2* m2 = nullptr;
+				if (kNumMixers > 1) {
+					for (size_t i = 0; i < kNumMixers; ++i) {
+						mps[i] = Clamp(mps[i], kMinST, kMaxST - 1);
+					}
+					m2 = mix2_.GetMixer() + mixer_ctx;
+					stp = m2->P(kMix2Bits, mps[0], mps[1], mps[2], mps[3]);
+				}
 				int mixer_p = table_.sqfast(stp); // Mix probabilities.
 				p = mixer_p;
 				bool sse3 = false;
@@ -647,13 +1072,37 @@ namespace cm {
 				const size_t kLimit = kMaxLearn - 1;
 				const size_t kDelta = 5;
 				// Returns false if we skipped the update due to a low error, should happen moderately frequently on highly compressible files.
-				bool ret = m0->Update(
-					mixer_p, bit,
-					kShift, kLimit, 600, 1,
-					// mixer_update_rate_[m0->NextLearn(8)], 16,
-					mixer_update_rate_[m0->GetLearn()], 16,
-					p0, p1, p2, p3, p4, p5, p6, p7, p8, p9, p10, p11, p12, p13, p14, p15
-				);
+				bool ret;
+				if (kNumMixers > 1) {
+					// Each first layer mixer learns from its own prediction, the final mixer decides whether the
+					// states are updated.
+					ret = m2->Update(
+						mixer_p, bit,
+						kShift, kLimit, 600, 1,
+						mixer_update_rate_[m2->GetLearn()], 18,
+						mps[0], mps[1], mps[2], mps[3]
+					);
+					int prs[kNumMixers];
+					int learn_mults[kNumMixers];
+					for (size_t i = 0; i < kNumMixers; ++i) {
+						prs[i] = table_.sqfast(mps[i]);
+						learn_mults[i] = mixer_update_rate_[ms[i]->GetLearn()];
+					}
+					MixerLayer<CMMixer, kNumMixers>::Update(
+						ms, prs, bit,
+						kShift, kLimit, 600, 1,
+						learn_mults, 16,
+						p0, p1, p2, p3, p4, p5, p6, p7, p8, p9, p10, p11, p12, p13, p14, p15
+					);
+				} else {
+					ret = m0->Update(
+						mixer_p, bit,
+						kShift, kLimit, 600, 1,
+						// mixer_update_rate_[m0->NextLearn(8)], 16,
+						mixer_update_rate_[m0->GetLearn()], 16,
+						p0, p1, p2, p3, p4, p5, p6, p7, p8, p9, p10, p11, p12, p13, p14, p15
+					);
+				}
 				// Only update the states / predictions if the mixer was far enough from the bounds, helps 60k on enwik8 and 1-2sec.
 				const bool kOptP = false;
 				if (ret) {
@@ -699,6 +1148,9 @@ namespace cm {
 				} else {
 					ent.encode(stream, bit, p, kShift);
 				}
+        if (track_miss_cost_) {
+          byte_cost_ += cost_table_.cost(p, bit ^ 1);
+        }
         if (bits == 1) {
           // ++ctx_count_[cur_ctx];  // Only for last context.
         }
@@ -706,7 +1158,7 @@ namespace cm {
         if (kDecode) {
           code = (code << 1) | bit;
         }
-        if (--bits == 4) {
+        if (--bits == 4 && !huffman) {
           auto nibble = ctx_state_.GetBits(cur_ctx);
           if (!kDecode) {
             dcheck(nibble == c / 16);
@@ -715,7 +1167,10 @@ namespace cm {
             match_model_.Fetch(nibble << 4);
           }
         }
-			} while (bits != 0);
+			} while (huffman ? !ByteState::IsLeaf(cur_ctx) : bits != 0);
+			if (kDecode && huffman) {
+				return Huffman::getChar(cur_ctx);
+			}
 			return kDecode ? code : c;
 		}
 
@@ -785,12 +1240,22 @@ namespace cm {
       if (cur.ModelEnabled(kModelOrder2, enabled)) {
         *(ctx_ptr++) = o2pos + (last_bytes_ & 0xFFFF) * o0size;
       }
-      uint32_t order = 3;
-      for (; order <= cur.MaxOrder(); ++order) {
-        h = HashFunc(buffer_[buffer_.Pos() - order], h);
-        if (cur.ModelEnabled(static_cast<ModelType>(kModelOrder0 + order), enabled)) {
-          *(ctx_ptr++) = HashLookup(h, true);
+      if (legacy_format_) {
+        h = LegacyOrderHash(2);
+        for (size_t order = 3; order <= cur.MaxOrder(); ++order) {
+          h = HashFunc(buffer_[buffer_.Pos() - order], h);
+          if (cur.ModelEnabled(static_cast<ModelType>(kModelOrder0 + order), enabled)) {
+            *(ctx_ptr++) = HashLookup(h, true);
+          }
+        }
+      } else {
+        for (size_t order = 3; order <= cur.MaxOrder(); ++order) {
+          if (cur.ModelEnabled(static_cast<ModelType>(kModelOrder0 + order), enabled)) {
+            *(ctx_ptr++) = HashLookup(OrderHash(order), true);
+          }
         }
+        // Match model hash.
+        h = OrderHash(std::max(cur.MaxOrder(), static_cast<size_t>(2)));
       }
       if (cur.ModelEnabled(kModelWord1, enabled)) {
         *(ctx_ptr++) = HashLookup(word_model_.getMixedHash() + 99912312, false); // Already prefetched.
@@ -816,16 +1281,7 @@ namespace cm {
       }
     }
 
-    // Optimal leaf algorithm.
-    uint64_t SolveOptimalLeaves(const uint64_t* cost) {
-      // DP array [node][remain] = max leaf values
-      static const size_t kCount = 1 << 16;
-      int64_t total[kCount];
-      std::fill_n(total, kCount, -1);
-      return DPOptimalLeaves(cost, total, 0, 64);
-    }
-
-    int NextNibbleLeaf(int node, size_t next) {
+    static int NextNibbleLeaf(int node, size_t next) {
       // 0
       // 1(1) 2(10)
       // 3(11) 4 (100) 5 (101) 6 (110)
@@ -882,6 +1338,27 @@ namespace cm {
       return slot;
     }
 
+    // Fold the cost of the last miss byte into the average of the path that coded it, then pick the
+    // path for the next bytes.
+    ALWAYS_INLINE void UpdateMissCost(uint32_t& avg_cost) {
+      avg_cost += byte_cost_ - (avg_cost >> kCostAvgShift);
+      ++mode_bytes_;
+      if (!fast_mode_) {
+        // The fast path wins near ties since it is several times faster.
+        if (mode_bytes_ >= kFullPathWarmup && (full_cost_ >> kCostAvgShift) >= kFastPathMinCost &&
+          fast_cost_ <= full_cost_ + (full_cost_ >> 6)) {
+          // Trust the fast path for longer each time the full models confirm it right away.
+          fast_run_ = mode_bytes_ == kFullPathWarmup ? std::min(fast_run_ * 2, kFastPathMaxRun) : kFastPathMinRun;
+          fast_mode_ = true;
+          fast_entry_cost_ = fast_cost_;
+          mode_bytes_ = 0;
+        }
+      } else if (fast_cost_ + (fast_cost_ >> 5) < fast_entry_cost_ || mode_bytes_ >= fast_run_) {
+        fast_mode_ = false;
+        mode_bytes_ = 0;
+      }
+    }
+
     template <const bool decode, typename TStream>
     size_t processByte(TStream& stream, uint32_t c = 0) {
       size_t base_contexts[kInputs] = {};
@@ -899,33 +1376,55 @@ namespace cm {
       size_t mm_len = 0;
       const size_t mm_order = cur_profile_.MatchModelOrder();
       if (mm_order != 0) {
+        if (long_match_) {
+          // The position is not in buffer_, don't extend it.
+          match_model_.resetMatch();
+          long_match_ = false;
+        }
         match_model_.update(buffer_);
-        if (mm_len = match_model_.getLength()) {
+        mm_len = match_model_.getLength();
+        if (mm_len == 0 && use_long_match_) {
+          if (long_match_model_.GetLength() == 0) {
+            long_match_model_.Find();
+          }
+          if (long_match_model_.GetLength() != 0) {
+            match_model_.SetExternalMatch(long_match_model_.GetLength());
+            mm_len = match_model_.getLength();
+            long_match_ = true;
+          }
+        }
+        if (mm_len != 0) {
           miss_len_ = 0;
           match_model_.setCtx(interval_model_ & 0xFF);
           match_model_.updateCurMdl();
-          expected_char = match_model_.getExpectedChar(buffer_);
-          uint32_t expected_bits = use_huffman ? huff.getCode(expected_char).length : 8;
-          size_t expected_code = use_huffman ? huff.getCode(expected_char).value : expected_char;
+          expected_char = long_match_ ?
+            long_match_model_.GetExpectedChar() : match_model_.getExpectedChar(buffer_);
+          uint32_t expected_bits = use_huffman_ ? huff.getCode(expected_char).length : 8;
+          size_t expected_code = use_huffman_ ? huff.getCode(expected_char).value : expected_char;
           match_model_.updateExpectedCode(expected_code, expected_bits);
         }
       }
 
-      uint32_t h = HashFunc((last_bytes_ & 0xFFFF) * 3, 0x4ec457c1 * 19);
+      uint32_t h = 0;
+      bool track_cost = false;
       if (mm_len == 0) {
         ++miss_len_;
         if (kStatistics) {
           ++other_count_;
           ++miss_count_[std::min(kMaxMiss - 1, miss_len_ / 32)];
         }
-        if (miss_len_ >= cur_profile_.MissFastPath()) {
+        bool use_fast = false;
+        // The fast path has its own nibble layout.
+        if (miss_len_ >= cur_profile_.MissFastPath() && !use_huffman_) {
+          track_cost = true;
+          byte_cost_ = 0;
+          use_fast = legacy_format_ || fast_mode_ || (mode_bytes_ % kFastPathProbeInterval == kFastPathProbeInterval - 1 &&
+            (full_cost_ >> kCostAvgShift) >= kFastPathMinCost);
+        }
+        if (use_fast) {
           if (kStatistics) ++fast_bytes_;
 
-          uint32_t mm_hash = h;
-          for (size_t order = 3; order <= mm_order; ++order) {
-            mm_hash = HashFunc(buffer_[bpos - order], mm_hash);
-          }
-          match_model_.setHash(mm_hash);
+          match_model_.setHash(MatchHash(mm_order));
 
           if (false) {
             if (decode) {
@@ -941,6 +1440,7 @@ namespace cm {
             uint32_t ch = c << 24;
             bool second_nibble = false;
             size_t base_ctx = 0;
+            size_t first_nibble = 0;
             for (;;) {
               auto* st0 = s0 + ctx;
               auto* st1 = s1 + ctx;
@@ -966,6 +1466,7 @@ namespace cm {
                 ent.encode(stream, bit, p, kShift);
                 ch <<= 1;
               }
+              byte_cost_ += cost_table_.cost(p, bit ^ 1);
               pr->update(bit, 10);
               *st0 = state_trans_[*st0][bit];
               *st1 = state_trans_[*st1][bit];
@@ -975,7 +1476,8 @@ namespace cm {
                 if (second_nibble) {
                   break;
                 }
-                base_ctx = 15 + (ctx ^ 0x10) * 15;
+                first_nibble = ctx ^ 0x10;
+                base_ctx = 15 + first_nibble * 15;
                 s0 += base_ctx;
                 s1 += base_ctx;
                 s2 += base_ctx;
@@ -984,9 +1486,10 @@ namespace cm {
               }
             }
             if (decode) {
-              c = ctx & 0xFF;
+              c = (first_nibble << 4) | (ctx & 0xF);
             }
           }
+          UpdateMissCost(fast_cost_);
           return c;
         }
       }
@@ -1045,7 +1548,9 @@ namespace cm {
       if (kStatistics) {
         (sse_ctx_ != 0 ? lzp_miss_bytes_ : normal_bytes_) += stream.tell() - cur_pos;
       }
-
+      if (track_cost) {
+        UpdateMissCost(full_cost_);
+      }
       return c;
     }
 
@@ -1053,6 +1558,7 @@ namespace cm {
       switch (profile) {
       case Detector::kProfileText: return kProfileText;
       case Detector::kProfileSimple: return kProfileSimple;
+      case Detector::kProfileStore: return kProfileBinary;  // Store blocks are not CM coded.
       }
       return kProfileBinary;
     }
@@ -1066,17 +1572,13 @@ namespace cm {
       GetHashes(h, cur_profile_, base_ctx, enabled);
       GetHashes(h, cur_match_profile_, base_ctx, match_enabled);
       for (size_t i = 0; i < kInputs; ++i) {
-        for (size_t j = 0; j < 256; ++j) {
-          probs_[i].SetLearn(j, learn[static_cast<size_t>(enabled[i])]);
-          probs_[i + kProbCtxPer].SetLearn(j, learn[static_cast<size_t>(match_enabled[i])]);
-        }
+        probs_[i].SetLearn(learn[static_cast<size_t>(enabled[i])]);
+        probs_[i + kProbCtxPer].SetLearn(learn[static_cast<size_t>(match_enabled[i])]);
       }
     }
 
     void SetDataProfile(DataProfile new_profile) {
-      if (!force_profile_) {
-        data_profile_ = new_profile;
-      }
+      data_profile_ = new_profile;
       interval_model_ = 0;
       small_interval_model_ = 0;
       word_model_.reset();
@@ -1110,6 +1612,10 @@ namespace cm {
         reorder = binary_reorder_;
         break;
       }
+      if (model_mask_ != 0) {
+        cur_profile_.SetEnabledModels(model_mask_);
+      }
+      track_miss_cost_ = cur_profile_.HasMissFastPath();
       reorder_.Copy(reorder);
       UpdateLearnRates();
     }
@@ -1128,14 +1634,29 @@ namespace cm {
         }
       }
       buffer_.Push(c);
+      if (use_long_match_) {
+        long_match_model_.update(c);
+      }
+      run_len_ = c == static_cast<uint8_t>(last_bytes_) ? run_len_ + 1 : 0;
       interval_model_ = (interval_model_ << 4) | current_interval_map_[c];
       interval_model2_ = (interval_model2_ << 4) | current_interval_map2_[c];
       small_interval_model_ = (small_interval_model_ * 8) + current_small_interval_map_[c];
+      last_bytes2_ = (last_bytes2_ << 8) | (last_bytes_ >> 56);
       last_bytes_ = (last_bytes_ << 8) | static_cast<uint8_t>(c);
       bracket_.Update(c);
       special_char_model_.Update(c);
     }
 
+    // Update for a byte coded by the run model. The byte histories and interval models are saturated
+    // with the run byte after kRunMinLen equal bytes, the word and bracket models skip the run.
+    ALWAYS_INLINE void UpdateRun(uint32_t c) {
+      buffer_.Push(c);
+      if (use_long_match_) {
+        long_match_model_.update(c);
+      }
+      ++run_len_;
+    }
+
     virtual void compress(Stream* in_stream, Stream* out_stream, uint64_t max_count);
     virtual void decompress(Stream* in_stream, Stream* out_stream, uint64_t max_count);
   };
@@ -101,6 +101,8 @@ public:
     kTypeCMMax,
     kTypeCMSimple,
     kTypeDMC,
+    // Stored in the archive, new types go at the end.
+    kTypeCMUltra,
   };
 
   class Factory {
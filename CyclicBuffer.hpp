@@ -29,6 +29,7 @@
 #include <cassert>
 #include <memory>
 
+#include "Memory.hpp"
 #include "Util.hpp"
 
 template <typename T>
@@ -36,12 +37,17 @@ class CyclicBuffer {
 protected:
   size_t pos_ = 0, mask_ = 0, alloc_size_ = 0;
   std::unique_ptr<T[]> storage_;
+  MirroredMemMap mirror_;
+  bool mirrored_ = false;
   T *data_;
 public:
 
   ALWAYS_INLINE size_t Pos() const { return pos_; }
   ALWAYS_INLINE size_t Mask() const { return mask_; }
   ALWAYS_INLINE T* Data() { return data_; }
+  // If mirrored, the Size() elements before and after Ptr(offset) are the ring contents.
+  ALWAYS_INLINE bool Mirrored() const { return mirrored_; }
+  ALWAYS_INLINE const T* Ptr(size_t offset) const { return &data_[offset & mask_]; }
   size_t Prev(size_t pos, size_t count) const {
     // Relies on integer underflow behavior. Works since pow 2 size.
     return (pos - count) & mask_;
@@ -84,10 +90,13 @@ public:
     pos_ = alloc_size_ = 0;
     mask_ = static_cast<size_t>(-1);
     storage_.reset();
+    mirror_.release();
+    mirrored_ = false;
     data_ = nullptr;
   }
   void Fill(T d) {
-    std::fill(&storage_[0], &storage_[0] + Size(), d);
+    T* start = mirrored_ ? data_ : &storage_[0];
+    std::fill(start, start + Size(), d);
   }
   void CopyStartToEndOfBuffer(size_t count) {
     size_t size = Size();
@@ -101,14 +110,22 @@ public:
       storage_[i] = storage_[i + size];
     }
   }
-  void Resize(size_t new_size, size_t padding = sizeof(uint32_t)) {
+  // Mirror requests a double mapped buffer, falls back to a padded buffer if not supported.
+  void Resize(size_t new_size, size_t padding = sizeof(uint32_t), bool mirror = false) {
     // Ensure power of 2.
     assert((new_size & (new_size - 1)) == 0);
-    storage_.release();
+    storage_.reset();
     mask_ = new_size - 1;
-    alloc_size_ = new_size + padding * 2;
-    storage_.reset(new T[alloc_size_]());
-    data_ = storage_.get() + padding;
+    mirrored_ = mirror && mirror_.resize(new_size * sizeof(T));
+    if (mirrored_) {
+      alloc_size_ = new_size;
+      data_ = reinterpret_cast<T*>(mirror_.getData());
+    } else {
+      mirror_.release();
+      alloc_size_ = new_size + padding * 2;
+      storage_.reset(new T[alloc_size_]());
+      data_ = storage_.get() + padding;
+    }
     Restart();
   }
 };
@@ -148,6 +165,17 @@ public:
   ALWAYS_INLINE T operator [] (size_t offset) const {
     return this->data_[(front_pos_ + offset) & this->Mask()];
   }
+  ALWAYS_INLINE const T* FrontPtr(size_t offset) const {
+    return this->Ptr(front_pos_ + offset);
+  }
+  // Elements from offset that can be read through FrontPtr(offset) without wrapping.
+  ALWAYS_INLINE size_t Contiguous(size_t offset) const {
+    const size_t remain = size_ - offset;
+    if (this->mirrored_) {
+      return remain;
+    }
+    return std::min(remain, Capacity() - ((front_pos_ + offset) & this->Mask()));
+  }
   ALWAYS_INLINE bool Full() const {
     return this->Size() == Capacity();
   }
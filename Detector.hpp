@@ -29,6 +29,7 @@
 
 #include "CyclicBuffer.hpp"
 #include "Dict.hpp"
+#include "Entropy.hpp"
 #include "JPEG.hpp"
 #include "Stream.hpp"
 #include "UTF8.hpp"
@@ -37,6 +38,9 @@
 
 // Detects blocks and data type from input data
 class Detector {
+  // Shorter runs of text chars are binary.
+  static const size_t kMinTextLen = 64;
+
   bool is_forbidden[256]; // Chars which don't appear in text often.
   bool is_word_or_ascii_art[256];
   uint8_t is_space[256];
@@ -49,17 +53,13 @@ class Detector {
   using BufferType = CyclicDeque<uint8_t>;
   BufferType buffer_;
 
-  // Out buffer, only used to store headers (for now).
-  StaticArray<uint8_t, 16 * KB> out_buffer_;
-  size_t out_buffer_pos_, out_buffer_size_;
-
-  // Read / write stream.
+  // Input stream.
   Stream* stream_;
 
   // Opt var
   size_t opt_var_;
 public:
-  // Pre-detected.
+  // Pre-detected, stored in the archive so new profiles go at the end.
   enum Profile {
     kProfileText,
     kProfileBinary,
@@ -67,9 +67,8 @@ public:
     kProfileSimple,
     kProfileSkip,  // SKip this block, hopefully due to dedupe, or maybe zero pad.
     kProfileEOF,
+    kProfileStore,  // Incompressible data, copied through.
     kProfileCount,
-    // Not a real profile, tells CM to use streaming detection.
-    kProfileDetect,
   };
 
   class DetectedBlock {
@@ -86,40 +85,6 @@ public:
       return *this;
     }
 
-    static size_t calculateLengthBytes(size_t length) {
-      if (length & 0xFF000000) return 4;
-      if (length & 0xFF0000) return 3;
-      if (length & 0xFF00) return 2;
-      return 1;
-    }
-    static size_t getSizeFromHeaderByte(uint8_t b) {
-      return 1 + getLengthBytes(b);
-    }
-    static size_t getLengthBytes(uint8_t b) {
-      return (b >> kLengthBytesShift) + 1;
-    }
-    size_t write(uint8_t* ptr) {
-      const auto* orig_ptr = ptr;
-      size_t enc_len = length_ - 1;
-      const auto length_bytes = calculateLengthBytes(enc_len);
-      *(ptr++) = static_cast<uint8_t>(profile_) | static_cast<uint8_t>((length_bytes - 1) << kLengthBytesShift);
-      for (size_t i = 0; i < length_bytes; ++i) {
-        *(ptr++) = static_cast<uint8_t>(enc_len >> (i * 8));
-      }
-      return ptr - orig_ptr;
-    }
-    size_t read(const uint8_t* ptr) {
-      const auto* orig_ptr = ptr;
-      auto c = *(ptr++);
-      profile_ = static_cast<Profile>(c & kDataProfileMask);
-      auto length_bytes = getLengthBytes(c);
-      length_ = 0;
-      for (size_t i = 0; i < length_bytes; ++i) {
-        length_ |= static_cast<uint32_t>(*(ptr++)) << (i * 8);
-      }
-      ++length_;
-      return ptr - orig_ptr;
-    }
     Profile profile() const {
       return profile_;
     }
@@ -139,8 +104,6 @@ public:
     }
 
   private:
-    static const size_t kLengthBytesShift = 6;
-    static const size_t kDataProfileMask = (1u << kLengthBytesShift) - 1;
     Profile profile_;
     uint64_t length_;
   };
@@ -150,25 +113,14 @@ public:
     case kProfileBinary: return "binary";
     case kProfileText: return "text";
     case kProfileWave16: return "wav16";
+    case kProfileStore: return "store";
     }
     return "unknown";
   }
 
-  // std::vector<DetectedBlock> detected_blocks_;
-  DetectedBlock current_block_;
-
-  // Detected but not already read.
-  DetectedBlock detected_block_;
-
   // Saved detected blocks.
   std::deque<DetectedBlock> saved_blocks_;
 
-  // Statistics
-  uint64_t num_blocks_[kProfileCount];
-  uint64_t num_bytes_[kProfileCount];
-  uint64_t overhead_bytes_;
-  uint64_t small_len_;
-
   // Spaces.
   size_t no_spaces_;
 
@@ -184,12 +136,6 @@ public:
   }
 
   void init() {
-    overhead_bytes_ = 0;
-    small_len_ = 0;
-    for (size_t i = 0; i < kProfileCount; ++i) {
-      num_blocks_[i] = num_bytes_[i] = 0;
-    }
-    out_buffer_pos_ = out_buffer_size_ = 0;
     for (auto& b : is_forbidden) b = false;
 
     const uint8_t forbidden_arr[] = {
@@ -233,89 +179,11 @@ public:
     return buffer_.Size();
   }
 
-  void put(int c) {
-    // Profile can't extend past the end of the buffer.
-    if (current_block_.length() > 0) {
-      current_block_.pop();
-      if (buffer_.Full()) {
-        flush();
-      }
-      buffer_.PushBack(c);
-    } else {
-      out_buffer_[out_buffer_pos_++] = static_cast<uint8_t>(c);
-      auto num_bytes = DetectedBlock::getSizeFromHeaderByte(out_buffer_[0]);
-      if (out_buffer_pos_ == num_bytes) {
-        current_block_.read(&out_buffer_[0]);
-        if (current_block_.profile() == kProfileEOF) {
-          out_buffer_pos_ = 0;
-        }
-        out_buffer_pos_ = 0;
-      }
-    }
-  }
-
-  Profile detect() {
-    if (current_block_.length() > 0) {
-      return current_block_.profile();
-    }
-    if (current_block_.profile() == kProfileEOF) {
-      return kProfileEOF;
-    }
-    return kProfileBinary;
-  }
-
-  void flush() {
-    // TODO: Optimize
-    BufferedStreamWriter<4 * KB> sout(stream_);
-    while (!buffer_.Empty()) {
-      sout.put(buffer_.Front());
-      buffer_.PopFront();
-    }
-    sout.flush();
-  }
-
   ALWAYS_INLINE uint32_t at(uint32_t index) const {
     assert(index < buffer_.Size());
     return buffer_[index];
   }
 
-  int get(Profile& profile) {
-    // Profile can't extend past the end of the buffer.
-    if (false && current_block_.length() == 0) {
-      current_block_ = detectBlock();
-    }
-    if (current_block_.length() > 0) {
-      profile = current_block_.profile();
-      return readChar();
-    }
-    // Still have some header to read?
-    if (out_buffer_pos_ < out_buffer_size_) {
-      if (++out_buffer_pos_ == out_buffer_size_) {
-        current_block_ = detected_block_;
-      }
-      overhead_bytes_ += out_buffer_size_;
-      profile = kProfileBinary;
-      return out_buffer_[out_buffer_pos_ - 1];
-    }
-    if (current_block_.profile() == kProfileEOF) {
-      profile = kProfileEOF;
-      return EOF;
-    }
-    detected_block_ = detectBlock();
-    ++num_blocks_[detected_block_.profile()];
-    num_bytes_[detected_block_.profile()] += detected_block_.length();
-    if (detected_block_.length() < 64) ++small_len_;
-    out_buffer_size_ = detected_block_.write(&out_buffer_[0]);
-    profile = kProfileBinary;
-    out_buffer_pos_ = 1;
-    return out_buffer_[0];
-  }
-
-  // Read char without detection.
-  uint8_t readChar() {
-    current_block_.pop();
-    return popChar();
-  }
   int popChar() {
     if (buffer_.Empty()) {
       RefillRead();
@@ -327,22 +195,55 @@ public:
     buffer_.PopFront();
     return ret;
   }
-  size_t read(uint8_t* out, size_t count) {
-    const auto n = std::min(count, buffer_.Size());
-    for (size_t i = 0; i < n; ++i) {
-      out[i] = buffer_[i];
-    }
-    buffer_.PopFront(n);
-    current_block_.pop(n);
-    return n;
-  }
 
-  void dumpInfo() {
-    std::cout << "Detector overhead " << formatNumber(overhead_bytes_) << " small=" << small_len_ << std::endl;
-    for (size_t i = 0; i < kProfileCount; ++i) {
-      std::cout << profileToString(static_cast<Profile>(i)) << "("
-        << formatNumber(num_blocks_[i]) << ") : " << formatNumber(num_bytes_[i]) << std::endl;
+  // Returns how many bytes from pos are binary without running the text scoring, 0 if unknown.
+  // A text run ends at the first forbidden char. While forbidden chars are at most kMinTextLen
+  // apart no run starting between them can be text. Scans 16 bytes at a time for control chars,
+  // and stops before a RIFF header could end since the wav and jpeg checks need to see it.
+  size_t SkipBinary(size_t pos) {
+    static const size_t kScanBytes = 256;
+    const size_t scan_bytes = std::min(buffer_.Contiguous(pos), kScanBytes) & ~static_cast<size_t>(15);
+    const uint8_t* ptr = buffer_.FrontPtr(pos);
+    const __m128i max_control = _mm_set1_epi8(31);
+    const __m128i riff_start = _mm_set1_epi8('R');
+    // One past the last forbidden char found.
+    size_t end = 0;
+    size_t first_r = scan_bytes;
+    for (size_t i = 0; i < scan_bytes && i <= end + kMinTextLen; i += 16) {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i));
+      const uint32_t r = _mm_movemask_epi8(_mm_cmpeq_epi8(v, riff_start));
+      if (r != 0 && first_r == scan_bytes) {
+        first_r = i + CountTrailingZeros(r);
+      }
+      uint32_t control = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, max_control), v));
+      for (; control != 0; control &= control - 1) {
+        const size_t idx = i + CountTrailingZeros(control);
+        if (idx > end + kMinTextLen || idx >= first_r + 4) {
+          i = scan_bytes;
+          break;
+        }
+        if (is_forbidden[ptr[idx]]) {
+          end = idx + 1;
+        }
+      }
+    }
+    if (end == 0) {
+      return 0;
+    }
+    // Headers ending before pos + 4 overlap the bytes already seen.
+    const uint32_t kRiff = MakeWord('R', 'I', 'F', 'F');
+    uint32_t word = last_word_;
+    for (size_t i = 0; i < 4 && i < end; ++i) {
+      if (word == kRiff) {
+        return 0;
+      }
+      word = (word << 8) | ptr[i];
     }
+    if (end > 4) {
+      word = MakeWord(ptr[end - 4], ptr[end - 3], ptr[end - 2], ptr[end - 1]);
+    }
+    last_word_ = word;
+    return end;
   }
 
   static bool IsWordOrAsciiArtChar(uint8_t c) {
@@ -366,6 +267,11 @@ public:
 
     size_t binary_len = 0;
     while (binary_len < buffer_size) {
+      const size_t skip = SkipBinary(binary_len);
+      if (skip != 0) {
+        binary_len += skip;
+        continue;
+      }
       UTF8Decoder<true> decoder;
       size_t text_len = 0;
       size_t space_count = 0;
@@ -418,7 +324,7 @@ public:
           }
         }
       }
-      if (text_len > 64) {
+      if (text_len > kMinTextLen) {
         uint8_t buf[512];
         char* bptr = reinterpret_cast<char*>(buf);
         for (size_t i = 0; i < sizeof(buf) && i < text_len; ++i) {
@@ -525,6 +431,18 @@ private:
 class Analyzer {
 public:
   static const bool kUseDedupe = false;
+  // Binary blocks are split into windows, windows with a higher order 0 entropy are stored.
+  static const size_t kEntropyWindowSize = 64 * KB;
+  static constexpr double kStoreEntropy = 7.99;
+  // Sampled analysis classifies kSampleStride chunks from kSamplesPerChunk samples of kSampleSize
+  // spread over each, chunks are analyzed fully if less than kSampleMajority / 16 of the sampled
+  // bytes have one profile.
+  static const uint64_t kSampleStride = 1 * MB;
+  static const size_t kSamplesPerChunk = 4;
+  static const size_t kSampleSize = 8 * KB;
+  static const uint64_t kSampleMajority = 15;
+  // Smaller files are always analyzed fully.
+  static const uint64_t kMinSampledLength = 32 * MB;
   typedef std::vector<Detector::DetectedBlock> Blocks;
 
   // Pos / len.
@@ -545,6 +463,9 @@ public:
       if (block.profile() == Detector::kProfileEOF) {
         break;
       }
+      const bool check_entropy = block.profile() == Detector::kProfileBinary;
+      uint32_t window_counts[256] = {};
+      size_t window_len = 0;
       for (size_t i = 0; i < block.length(); ++i) {
         auto c = detector.popChar();
         if (kUseDedupe && c != EOF) {
@@ -602,28 +523,79 @@ public:
         if (block.profile() == Detector::kProfileText) {
           dict_builder_.AddChar(c);
         }
+        if (check_entropy) {
+          ++window_counts[c];
+          if (++window_len == kEntropyWindowSize) {
+            addWindow(window_counts, window_len);
+          }
+        }
       }
-      const size_t size = blocks_.size();
-      if (size > 0 && blocks_.back().profile() == block.profile()) {
-        // Same type, extend.
-        blocks_.back().extend(block.length());
+      if (check_entropy) {
+        addWindow(window_counts, window_len);
       } else {
-        const size_t min_binary_length = 1;
-        // replace <text> <bin> <text> with <text> if |<bin>| < min_binary_length.
-        if (block.profile() == Detector::kProfileText && size >= 2) {
-          auto& b1 = blocks_[size - 1];
-          auto& b2 = blocks_[size - 2];
-          if (b1.profile() == Detector::kProfileBinary &&
-            b2.profile() == Detector::kProfileText &&
-            b1.length() < min_binary_length) {
-            b2.extend(b1.length() + block.length());
-            blocks_.pop_back();
-            continue;
-          }
+        addBlock(block);
+      }
+    }
+  }
+  // Only reads samples of homogeneous chunks, those get the profile of their sample and text
+  // samples go to the dictionary builder. Returns false without adding blocks if a sample has a
+  // wav header, the full analysis is needed to find where the wav data ends.
+  bool analyzeSampled(Stream* stream, uint64_t length, size_t file_idx = 0) {
+    Blocks saved_blocks;
+    saved_blocks.swap(blocks_);
+    Blocks sampled_blocks;
+    std::vector<uint8_t> buffer;
+    bool found_wav = false;
+    for (uint64_t pos = 0; pos < length && !found_wav; pos += kSampleStride) {
+      const size_t chunk_len = static_cast<size_t>(std::min(kSampleStride, length - pos));
+      const size_t sample_stride = chunk_len / kSamplesPerChunk;
+      uint64_t sampled = 0;
+      uint32_t counts[256] = {};
+      for (size_t i = 0; i < kSamplesPerChunk; ++i) {
+        buffer.resize(std::min(kSampleSize, chunk_len - i * sample_stride));
+        buffer.resize(stream->readat(pos + i * sample_stride, &buffer[0], buffer.size()));
+        ReadMemoryStream sample(&buffer);
+        analyze(&sample, file_idx);
+        sampled += buffer.size();
+        for (uint8_t c : buffer) {
+          ++counts[c];
         }
-        blocks_.push_back(block);
       }
+      uint64_t bytes[Detector::kProfileCount] = {};
+      for (const auto& b : blocks_) {
+        bytes[b.profile()] += b.length();
+      }
+      found_wav = bytes[Detector::kProfileWave16] != 0;
+      const auto* majority = std::max_element(bytes, bytes + Detector::kProfileCount);
+      if (*majority * 16 >= sampled * kSampleMajority || sampled >= chunk_len) {
+        auto profile = static_cast<Detector::Profile>(majority - bytes);
+        if (profile == Detector::kProfileBinary || profile == Detector::kProfileStore) {
+          // Each sample is too small for the window entropy check, use the histogram of all of them.
+          profile = Order0Entropy(counts, 256) >= storeEntropy(sampled) ?
+            Detector::kProfileStore : Detector::kProfileBinary;
+        }
+        sampled_blocks.push_back(Detector::DetectedBlock(profile, chunk_len));
+      } else {
+        blocks_.clear();
+        buffer.resize(chunk_len);
+        buffer.resize(stream->readat(pos, &buffer[0], buffer.size()));
+        ReadMemoryStream chunk(&buffer);
+        analyze(&chunk, file_idx);
+        found_wav = found_wav || std::any_of(blocks_.begin(), blocks_.end(), [](const Detector::DetectedBlock& b) {
+          return b.profile() == Detector::kProfileWave16;
+        });
+        sampled_blocks.insert(sampled_blocks.end(), blocks_.begin(), blocks_.end());
+      }
+      blocks_.clear();
     }
+    blocks_.swap(saved_blocks);
+    if (found_wav) {
+      return false;
+    }
+    for (const auto& b : sampled_blocks) {
+      addBlock(b);
+    }
+    return true;
   }
   void dump() {
     uint64_t blocks[Detector::kProfileCount] = { 0 };
@@ -651,6 +623,48 @@ public:
   Analyzer() : opt_var_(0) {}
 
 private:
+  void addBlock(const Detector::DetectedBlock& block) {
+    const size_t size = blocks_.size();
+    if (size > 0 && blocks_.back().profile() == block.profile()) {
+      // Same type, extend.
+      blocks_.back().extend(block.length());
+      return;
+    }
+    const size_t min_binary_length = 1;
+    // replace <text> <bin> <text> with <text> if |<bin>| < min_binary_length.
+    if (block.profile() == Detector::kProfileText && size >= 2) {
+      auto& b1 = blocks_[size - 1];
+      auto& b2 = blocks_[size - 2];
+      if (b1.profile() == Detector::kProfileBinary &&
+        b2.profile() == Detector::kProfileText &&
+        b1.length() < min_binary_length) {
+        b2.extend(b1.length() + block.length());
+        blocks_.pop_back();
+        return;
+      }
+    }
+    blocks_.push_back(block);
+  }
+
+  // Store threshold for the order 0 entropy of len sampled bytes. The entropy of random data is
+  // about 255 / (2 len ln 2) bits short of 8, so the threshold moves by the difference to a window.
+  static double storeEntropy(uint64_t len) {
+    const double bias = 255.0 / (2.0 * std::log(2.0));
+    const double n = static_cast<double>(std::max(len, static_cast<uint64_t>(kSampleSize)));
+    return kStoreEntropy - bias * (1.0 / n - 1.0 / static_cast<double>(kEntropyWindowSize));
+  }
+
+  // Add a window of a binary block, resets the counts.
+  void addWindow(uint32_t* counts, size_t& len) {
+    if (len == 0) {
+      return;
+    }
+    const bool store = Order0Entropy(counts, 256) >= kStoreEntropy;
+    addBlock(Detector::DetectedBlock(store ? Detector::kProfileStore : Detector::kProfileBinary, len));
+    std::fill_n(counts, 256, 0u);
+    len = 0;
+  }
+
   Blocks blocks_;
   Dict::Builder dict_builder_;
   Deduplicator dedupe_;
@@ -32,6 +32,7 @@
 #include <unordered_set>
 
 #include "Filter.hpp"
+#include "SuffixArray.hpp"
 #include "WordCounter.hpp"
 
 enum WordModifier {
@@ -192,32 +193,87 @@ public:
   };
 
   class Builder {
-    static const size_t kSuffixSize = 100 * MB;
-    // Suffix array buffer.
-    std::vector<uint8_t> buffer_;
-    size_t buffer_pos_;
     // Current word.
     static const size_t kMinWordLen = 3;
     static const size_t kMaxWordLen = 0x20;
     static const size_t kDefaultMinOccurrences = 8;
+    // The cached word list keeps words down to this count so that callers can ask for any threshold
+    // at or above it, whichever asks first.
+    static const size_t kMinListOccurrences = 4;
+    static const size_t kDefaultWordMemory = 256 * MB;
     uint8_t word_[kMaxWordLen];
     size_t word_pos_;
     // CC: first char EOR whole word.
-    WordCounter words_;
-    FrequencyCounter<256> counter_;
+    ShardedWordCounter words_;
+    // Words with at least word_list_min_ occurrences, the counter is freed once they are extracted.
+    std::vector<WordCount> word_list_;
+    bool has_word_list_ = false;
+    size_t word_list_min_ = 0;
+    ::FrequencyCounter<256> counter_;
+    // Phrases are picked from the start of the text.
+    static const size_t kPhraseSampleSize = 2 * MB;
+    static const size_t kMinPhraseLen = 12;
+    static const size_t kMaxPhraseLen = 64;
+    static const size_t kMaxPhrases = 512;
+    // Occurrences in the sample.
+    static const size_t kMinPhraseOccurrences = 8;
+    static const size_t kPhraseParseRounds = 2;
+    bool phrases_enabled_ = false;
+    std::vector<uint8_t> phrase_sample_;
+    // Phrases with their sample counts, for phrase_sample_size_ bytes of sample.
+    std::vector<WordCount> phrases_;
+    size_t phrase_sample_size_ = 0;
 
   public:
+    // The filter may be created more than once for a block, the first call keeps the word list and
+    // frees the counter. The list is cut at word_list_min_, later calls may not ask for less.
     void GetWords(std::vector<WordCount>& out, size_t min_occurences = kDefaultMinOccurrences) {
-      words_.GetWords(out, min_occurences);
-      words_.Clear();
+      if (!has_word_list_) {
+        word_list_min_ = std::min(min_occurences, kMinListOccurrences);
+        words_.GetWords(word_list_, word_list_min_);
+        words_.Clear();
+        has_word_list_ = true;
+      }
+      check(min_occurences >= word_list_min_);
+      for (const auto& wc : word_list_) {
+        if (wc.Count() >= min_occurences) {
+          out.push_back(wc);
+        }
+      }
+    }
+
+    // Keep a sample of the text for GetPhrases.
+    void EnablePhrases() {
+      phrases_enabled_ = true;
     }
 
-    FrequencyCounter<256>& FrequencyCounter() {
+    // Frequent strings of several words (or punctuation) which start where the filter can emit a
+    // code word and end on a word boundary. The counts are scaled from the sample to all of the text.
+    void GetPhrases(std::vector<WordCount>& out, size_t min_occurences = kDefaultMinOccurrences) {
+      if (phrase_sample_size_ != phrase_sample_.size()) {
+        FindPhrases();
+      }
+      const uint64_t text_size = counter_.Sum();
+      for (const auto& p : phrases_) {
+        const uint64_t count = p.Count() * text_size / phrase_sample_size_;
+        if (count >= min_occurences && count <= std::numeric_limits<uint32_t>::max()) {
+          WordCount wc(p.Word(), static_cast<uint32_t>(count));
+          if (wc.Savings(2) > 0) {
+            out.push_back(wc);
+          }
+        }
+      }
+    }
+
+    ::FrequencyCounter<256>& FrequencyCounter() {
       return counter_;
     }
 
     void AddChar(uint8_t c) {
       counter_.Add(c);
+      if (phrases_enabled_ && phrase_sample_.size() < kPhraseSampleSize) {
+        phrase_sample_.push_back(c);
+      }
       // Add to current word.
       if (IsWordChar(c)) {
         if (word_pos_ < kMaxWordLen) {
@@ -242,24 +298,153 @@ public:
             words_.AddWord(word_, word_ + word_pos_, cc_type);
           }
         }
-        if (false) for (size_t i = 0; i < word_pos_; ++i) {
-          if (buffer_pos_ < buffer_.capacity()) buffer_.push_back(word_[i]);
-        }
-        if (false) if (buffer_pos_ < buffer_.capacity()) buffer_.push_back(c);
         word_pos_ = 0;
       }
     }
-    void init() {
-      buffer_pos_ = 0;
-      buffer_.reserve(kSuffixSize);
+    void init(size_t word_memory = kDefaultWordMemory) {
       word_pos_ = 0;
-      words_.Init(256 * MB);
+      // Only allocated once there is text.
+      words_.Init(word_memory);
     }
-    Builder() {
-      init();
+    explicit Builder(size_t word_memory = kDefaultWordMemory) {
+      init(word_memory);
     }
-    const std::vector<uint8_t>* getBuffer() const {
-      return &buffer_;
+
+  private:
+    // Phrases don't start or end inside words or numbers.
+    static ALWAYS_INLINE bool IsTokenChar(int c) {
+      return IsWordChar(c) || (c >= '0' && c <= '9');
+    }
+
+    // The filter only emits code words after a non word char.
+    ALWAYS_INLINE bool IsPhraseStart(size_t pos) const {
+      if (pos == 0) {
+        return true;
+      }
+      const uint8_t prev = phrase_sample_[pos - 1];
+      return !IsTokenChar(prev) || (!IsWordChar(prev) && !IsTokenChar(phrase_sample_[pos]));
+    }
+
+    void FindPhrases() {
+      const auto start_time = clock();
+      const uint8_t* const s = phrase_sample_.empty() ? nullptr : &phrase_sample_[0];
+      const size_t n = phrase_sample_.size();
+      phrase_sample_size_ = n;
+      phrases_.clear();
+      std::vector<int32_t> sa;
+      SuffixArray::Build(s, n, &sa);
+      // Only the suffixes the filter can start a code word at, in sorted order.
+      std::vector<int32_t> starts;
+      for (int32_t pos : sa) {
+        if (IsPhraseStart(pos)) {
+          starts.push_back(pos);
+        }
+      }
+      sa.clear();
+      sa.shrink_to_fit();
+      // Common prefix with the previous start, 0 bytes end the strings since they terminate the
+      // words in the stored dictionary.
+      auto common_len = [s, n](size_t a, size_t b) {
+        size_t len = 0;
+        const size_t max_len = std::min(kMaxPhraseLen, n - std::max(a, b));
+        while (len < max_len && s[a + len] == s[b + len] && s[a + len] != 0) {
+          ++len;
+        }
+        return len;
+      };
+      // Bottom up traversal of the LCP intervals, each interval is a string which starts count times.
+      struct Interval {
+        size_t lcp;
+        size_t lb;
+      };
+      std::vector<Interval> stack;
+      stack.push_back(Interval{ 0, 0 });
+      std::vector<std::pair<int64_t, WordCount>> candidates;
+      for (size_t i = 1; i <= starts.size(); ++i) {
+        const size_t lcp = i < starts.size() ? common_len(starts[i - 1], starts[i]) : 0;
+        size_t lb = i - 1;
+        while (stack.back().lcp > lcp) {
+          const Interval top = stack.back();
+          stack.pop_back();
+          const size_t parent_lcp = std::max(lcp, stack.back().lcp);
+          AddPhraseCandidate(starts[top.lb], top.lcp, parent_lcp, i - top.lb, &candidates);
+          lb = top.lb;
+        }
+        if (stack.back().lcp < lcp) {
+          stack.push_back(Interval{ lcp, lb });
+        }
+      }
+      std::sort(candidates.begin(), candidates.end(), [](const std::pair<int64_t, WordCount>& a,
+                                                         const std::pair<int64_t, WordCount>& b) {
+        return a.first > b.first || (a.first == b.first && a.second.Word() < b.second.Word());
+      });
+      for (size_t i = 0; i < candidates.size() && i < kMaxPhrases; ++i) {
+        phrases_.push_back(candidates[i].second);
+      }
+      // Nested phrases were counted for the same occurrences, count what a longest match parse of
+      // the sample actually uses. Dropping phrases gives more uses to the others, repeat.
+      for (size_t round = 0; round < kPhraseParseRounds; ++round) {
+        CountPhraseUses();
+        auto it = std::remove_if(phrases_.begin(), phrases_.end(), [](const WordCount& p) {
+          return p.Count() < kMinPhraseOccurrences || p.Savings(2) <= 0;
+        });
+        phrases_.erase(it, phrases_.end());
+      }
+      std::cout << "Phrases " << phrases_.size() << "/" << candidates.size() << " from "
+        << prettySize(n) << " in " << clockToSeconds(clock() - start_time) << "s" << std::endl;
+    }
+
+    void CountPhraseUses() {
+      PhraseMap phrase_map;
+      for (size_t i = 0; i < phrases_.size(); ++i) {
+        CodeWord code_word;
+        code_word.setCode(static_cast<uint32_t>(i));
+        phrase_map.Add(phrases_[i].Word(), code_word);
+      }
+      phrase_map.Build();
+      uint8_t is_word_char[256];
+      for (size_t i = 0; i < 256; ++i) {
+        is_word_char[i] = IsWordChar(i);
+      }
+      std::vector<uint32_t> uses(phrases_.size(), 0u);
+      const size_t n = phrase_sample_.size();
+      for (size_t pos = 0; pos < n; ) {
+        size_t len = 0;
+        const CodeWord* code_word = IsPhraseStart(pos) ?
+          phrase_map.Find(&phrase_sample_[pos], n - pos, is_word_char, &len) : nullptr;
+        if (code_word != nullptr) {
+          ++uses[code_word->code_];
+          pos += len;
+        } else {
+          ++pos;
+        }
+      }
+      for (size_t i = 0; i < phrases_.size(); ++i) {
+        phrases_[i] = WordCount(phrases_[i].Word(), uses[i]);
+      }
+    }
+
+    // The interval shares lcp bytes at pos, the longer lengths than parent_lcp occur count times.
+    // Keep the longest one which ends on a word boundary and has more than one word.
+    void AddPhraseCandidate(size_t pos, size_t lcp, size_t parent_lcp, size_t count,
+                            std::vector<std::pair<int64_t, WordCount>>* candidates) {
+      if (count < kMinPhraseOccurrences) {
+        return;
+      }
+      const uint8_t* const s = &phrase_sample_[pos];
+      for (size_t len = lcp; len > parent_lcp && len >= kMinPhraseLen; --len) {
+        // All the occurrences share the char after the phrase only for len < lcp.
+        if (IsTokenChar(s[len - 1]) && (len == lcp || IsTokenChar(s[len]))) {
+          continue;
+        }
+        // A word followed by a single separator is not a phrase.
+        if (std::all_of(s, s + len - 1, IsWordChar)) {
+          break;
+        }
+        WordCount wc(std::string(s, s + len), static_cast<uint32_t>(count));
+        candidates->push_back(std::make_pair(wc.Savings(2), wc));
+        break;
+      }
     }
   };
 
@@ -273,6 +458,7 @@ public:
 
       std::vector<WordCount> word_pairs;
       builder.GetWords(word_pairs, min_occurrences);
+      builder.GetPhrases(word_pairs, min_occurrences);
       const auto occurences = word_pairs.size();
       std::sort(word_pairs.rbegin(), word_pairs.rend(), WordCount::CompareSavings(1));
 
@@ -365,29 +551,220 @@ public:
     codes.Add(128, 255);
   }
 
+  // Minimal perfect hash (hash and displace) from the lower case code words to their codes. The
+  // words are known before encoding starts, Build is called once after the last Add. A lookup is
+  // one hash, one displacement read and one compare against the word stored in the slot.
   class EncodeMap {
+    // Average number of words per displacement bucket.
+    static const size_t kBucketSize = 4;
   public:
     struct Entry {
       CodeWord code_word;
       WordCC word_case;
     };
 
+    // The first code for a word wins.
     void Add(const std::string& word, const CodeWord& code_word) {
       std::string lower_case(word);
       auto word_case = GetWordCase(reinterpret_cast<const uint8_t*>(word.c_str()), word.length());
       for (auto& c : lower_case) {
         c = MakeLowerCase(c);
       }
-      map_.emplace(lower_case, Entry{ code_word, word_case });
+      if (added_.insert(lower_case).second) {
+        pending_.push_back(std::make_pair(lower_case, Entry{ code_word, word_case }));
+      }
+    }
+
+    void Build() {
+      const size_t count = pending_.size();
+      slots_.assign(count, Slot());
+      displacements_.assign(count / kBucketSize + 1, 0u);
+      chars_.clear();
+      std::vector<uint64_t> hashes(count);
+      std::vector<std::vector<uint32_t>> buckets(displacements_.size());
+      for (size_t i = 0; i < count; ++i) {
+        const auto& word = pending_[i].first;
+        hashes[i] = Hash(reinterpret_cast<const uint8_t*>(word.data()), word.length());
+        buckets[BucketIndex(hashes[i])].push_back(static_cast<uint32_t>(i));
+      }
+      // Largest buckets first while most slots are free.
+      std::vector<uint32_t> order(buckets.size());
+      std::iota(order.begin(), order.end(), 0u);
+      std::sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+      });
+      std::vector<bool> used(count, false);
+      std::vector<size_t> bucket_slots;
+      for (uint32_t bucket : order) {
+        const auto& words = buckets[bucket];
+        if (words.empty()) {
+          break;
+        }
+        for (uint32_t displacement = 0; ; ++displacement) {
+          check(displacement != std::numeric_limits<uint32_t>::max());
+          bucket_slots.clear();
+          for (uint32_t idx : words) {
+            const size_t slot = SlotIndex(hashes[idx], displacement);
+            if (used[slot] || std::find(bucket_slots.begin(), bucket_slots.end(), slot) != bucket_slots.end()) {
+              break;
+            }
+            bucket_slots.push_back(slot);
+          }
+          if (bucket_slots.size() == words.size()) {
+            displacements_[bucket] = displacement;
+            break;
+          }
+        }
+        for (size_t i = 0; i < words.size(); ++i) {
+          const auto& word = pending_[words[i]].first;
+          Slot& slot = slots_[bucket_slots[i]];
+          used[bucket_slots[i]] = true;
+          slot.offset = static_cast<uint32_t>(chars_.size());
+          slot.length = static_cast<uint32_t>(word.length());
+          slot.entry = pending_[words[i]].second;
+          chars_.insert(chars_.end(), word.begin(), word.end());
+        }
+      }
+      pending_.clear();
+      added_.clear();
     }
 
-    const Entry* Find(const std::string& word) const {
-      auto it = map_.find(word);
-      return it != map_.end() ? &it->second : nullptr;
+    // Word must already be in lower case.
+    ALWAYS_INLINE const Entry* Find(const uint8_t* word, size_t len) const {
+      if (slots_.empty()) {
+        return nullptr;
+      }
+      const uint64_t hash = Hash(word, len);
+      const Slot& slot = slots_[SlotIndex(hash, displacements_[BucketIndex(hash)])];
+      if (slot.length != len || memcmp(&chars_[slot.offset], word, len) != 0) {
+        return nullptr;
+      }
+      return &slot.entry;
     }
 
   private:
-    std::unordered_map<std::string, Entry> map_;
+    struct Slot {
+      uint32_t offset = 0;
+      uint32_t length = 0;
+      Entry entry;
+    };
+
+    static ALWAYS_INLINE uint64_t Mix(uint64_t h) {
+      h ^= h >> 33;
+      h *= 0xFF51AFD7ED558CCDULL;
+      h ^= h >> 33;
+      return h;
+    }
+
+    static ALWAYS_INLINE uint64_t Hash(const uint8_t* word, size_t len) {
+      uint64_t h = len * 0x9E3779B97F4A7C15ULL;
+      size_t i = 0;
+      for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t v;
+        memcpy(&v, word + i, sizeof(v));
+        h = (h ^ v) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+      }
+      uint64_t v = 0;
+      for (size_t shift = 0; i < len; ++i, shift += 8) {
+        v |= static_cast<uint64_t>(word[i]) << shift;
+      }
+      return Mix((h ^ v) * 0x9E3779B97F4A7C15ULL);
+    }
+
+    // Multiply and shift instead of a modulo.
+    static ALWAYS_INLINE size_t Reduce(uint32_t h, size_t n) {
+      return static_cast<size_t>((static_cast<uint64_t>(h) * n) >> 32);
+    }
+
+    ALWAYS_INLINE size_t BucketIndex(uint64_t hash) const {
+      return Reduce(static_cast<uint32_t>(hash >> 32), displacements_.size());
+    }
+
+    ALWAYS_INLINE size_t SlotIndex(uint64_t hash, uint32_t displacement) const {
+      return Reduce(static_cast<uint32_t>(Mix(hash + displacement * 0xC2B2AE3D27D4EB4FULL)), slots_.size());
+    }
+
+    std::vector<uint32_t> displacements_;
+    std::vector<Slot> slots_;
+    // Words of the slots, back to back.
+    std::vector<uint8_t> chars_;
+    // Words added since the last build.
+    std::vector<std::pair<std::string, Entry>> pending_;
+    std::unordered_set<std::string> added_;
+  };
+
+  // Phrases are matched exactly, longest first. A 16 bit hash of the first kPrefixLen bytes rejects
+  // most positions before the binary search of the phrases with the same prefix.
+  class PhraseMap {
+    static const size_t kPrefixLen = sizeof(uint32_t);
+    static const size_t kPrefixBits = 16;
+  public:
+    static bool IsPhrase(const std::string& word) {
+      return word.length() >= kPrefixLen && !std::all_of(word.begin(), word.end(), [](char c) { return IsWordChar(static_cast<uint8_t>(c)); });
+    }
+
+    void Add(const std::string& phrase, const CodeWord& code_word) {
+      check(phrase.length() >= kPrefixLen);
+      Phrase p;
+      memcpy(&p.prefix, phrase.data(), kPrefixLen);
+      p.phrase = phrase;
+      p.code_word = code_word;
+      phrases_.push_back(p);
+    }
+
+    void Build() {
+      std::sort(phrases_.begin(), phrases_.end(), [](const Phrase& a, const Phrase& b) {
+        return a.prefix < b.prefix || (a.prefix == b.prefix && a.phrase.length() > b.phrase.length());
+      });
+      prefix_bits_.assign((1u << kPrefixBits) / 64, 0u);
+      for (const auto& p : phrases_) {
+        const size_t bit = PrefixHash(p.prefix);
+        prefix_bits_[bit / 64] |= static_cast<uint64_t>(1) << (bit % 64);
+      }
+    }
+
+    // The phrase must be followed by a non word char if it ends with a word char.
+    ALWAYS_INLINE const CodeWord* Find(const uint8_t* ptr, size_t max_len, const uint8_t* is_word_char,
+                                       size_t* len) const {
+      if (phrases_.empty() || max_len < kPrefixLen) {
+        return nullptr;
+      }
+      uint32_t prefix;
+      memcpy(&prefix, ptr, kPrefixLen);
+      const size_t bit = PrefixHash(prefix);
+      if ((prefix_bits_[bit / 64] >> (bit % 64) & 1) == 0) {
+        return nullptr;
+      }
+      auto it = std::lower_bound(phrases_.begin(), phrases_.end(), prefix, [](const Phrase& p, uint32_t prefix) {
+        return p.prefix < prefix;
+      });
+      for (; it != phrases_.end() && it->prefix == prefix; ++it) {
+        const size_t phrase_len = it->phrase.length();
+        if (phrase_len > max_len ||
+            (is_word_char[static_cast<uint8_t>(it->phrase.back())] && (phrase_len == max_len || is_word_char[ptr[phrase_len]])) ||
+            memcmp(ptr, it->phrase.data(), phrase_len) != 0) {
+          continue;
+        }
+        *len = phrase_len;
+        return &it->code_word;
+      }
+      return nullptr;
+    }
+
+  private:
+    struct Phrase {
+      uint32_t prefix;
+      std::string phrase;
+      CodeWord code_word;
+    };
+
+    static ALWAYS_INLINE size_t PrefixHash(uint32_t prefix) {
+      return (prefix * 0x9E3779B1u) >> (32 - kPrefixBits);
+    }
+
+    std::vector<Phrase> phrases_;
+    std::vector<uint64_t> prefix_bits_;
   };
 
   // Encodes / decods words / code words.
@@ -406,17 +783,24 @@ public:
 
     // Encoding data structures.
     EncodeMap encode_map_;
+    PhraseMap phrase_map_;
 
     // State
     uint8_t last_char_;
     bool capital_mode_ = false;
 
-    // Decode data structures
-    std::vector<std::string> words1b;
+    // Decode data structures, the words for each code length are consecutive in decode_words_.
+    struct DecodeWord {
+      uint32_t offset;
+      uint32_t length;
+    };
+    std::vector<DecodeWord> decode_words_;
+    // Words back to back, padded so that every word can be copied 16 bytes at a time.
+    std::vector<uint8_t> decode_chars_;
+    size_t words2b_idx_ = 0;
+    size_t words3b_idx_ = 0;
     size_t word1bstart;
-    std::vector<std::string> words2b;
     size_t word2bstart;
-    std::vector<std::string> words3b;
     size_t word3bstart;
 
     // Optimizations
@@ -533,8 +917,9 @@ public:
         WordCount wc(rms.readString());
         words.push_back(wc);
       }
-      // Generate the actual encode map.
+      // Generate the actual decode table.
       generate(words, num1, num2, num3, false, nullptr, num_codes);
+      decode_chars_.resize(decode_chars_.size() + sizeof(__m128i), 0u);
       std::cout << "Dictionary words=" << words.size() << " size=" << prettySize(dict_buffer_.size()) << std::endl;
     }
     void generate(std::vector<WordCount>& words,
@@ -552,22 +937,23 @@ public:
       for (size_t b1 = code_word_start; b1 < end1; ++b1) {
         if (idx < words.size()) {
           if (encode) {
-            encode_map_.Add(words[idx].Word(), CodeWord(1, static_cast<uint8_t>(b1)));
+            AddEncodeWord(words[idx].Word(), CodeWord(1, static_cast<uint8_t>(b1)));
             if (fc != nullptr) {
               words[idx].UpdateFrequencies(fc, escape_cap_first_, escape_cap_word_);
               fc->Add(b1, words[idx].Count());
             }
             ++idx;
           } else {
-            words1b.push_back(words[idx++].Word());
+            AddDecodeWord(words[idx++].Word());
           }
         }
       }
+      words2b_idx_ = decode_words_.size();
       for (size_t b1 = end1; b1 < end2; ++b1) {
         for (size_t b2 = (kOverlapCodewords ? code_word_start : end1); b2 < (kOverlapCodewords ? 256u : end2); ++b2) {
           if (idx < words.size()) {
             if (encode) {
-              encode_map_.Add(words[idx].Word(), CodeWord(2, static_cast<uint8_t>(b1), static_cast<uint8_t>(b2)));
+              AddEncodeWord(words[idx].Word(), CodeWord(2, static_cast<uint8_t>(b1), static_cast<uint8_t>(b2)));
               if (fc != nullptr) {
                 words[idx].UpdateFrequencies(fc, escape_cap_first_, escape_cap_word_);
                 fc->Add(b1, words[idx].Count());
@@ -575,17 +961,18 @@ public:
               }
               ++idx;
             } else {
-              words2b.push_back(words[idx++].Word());
+              AddDecodeWord(words[idx++].Word());
             }
           }
         }
       }
+      words3b_idx_ = decode_words_.size();
       for (size_t b1 = end2; b1 < end3; ++b1) {
         for (size_t b2 = (kOverlapCodewords ? code_word_start : end2); b2 < (kOverlapCodewords ? 256u : end3); ++b2) {
           for (size_t b3 = (kOverlapCodewords ? code_word_start : end2); b3 < (kOverlapCodewords ? 256u : end3); ++b3) {
             if (idx < words.size()) {
               if (encode) {
-                encode_map_.Add(words[idx].Word(), CodeWord(3, static_cast<uint8_t>(b1), static_cast<uint8_t>(b2), static_cast<uint8_t>(b3)));
+                AddEncodeWord(words[idx].Word(), CodeWord(3, static_cast<uint8_t>(b1), static_cast<uint8_t>(b2), static_cast<uint8_t>(b3)));
                 if (fc != nullptr) {
                   words[idx].UpdateFrequencies(fc, escape_cap_first_, escape_cap_word_);
                   fc->Add(b1, words[idx].Count());
@@ -594,12 +981,58 @@ public:
                   ++idx;
                 }
               } else {
-                words3b.push_back(words[idx++].Word());
+                AddDecodeWord(words[idx++].Word());
               }
             }
           }
         }
       }
+      if (encode) {
+        encode_map_.Build();
+        phrase_map_.Build();
+      }
+    }
+    ALWAYS_INLINE uint8_t* WriteCodeWord(uint8_t* out_ptr, const CodeWord& code_word) {
+      const auto num_bytes = code_word.numBytes();
+      dcheck(num_bytes >= 1 && num_bytes <= 3);
+      *(out_ptr++) = code_word.byte1();
+      if (num_bytes > 1) *(out_ptr++) = static_cast<uint8_t>(code_word.byte2());
+      if (num_bytes > 2) *(out_ptr++) = static_cast<uint8_t>(code_word.byte3());
+      return out_ptr;
+    }
+    void AddEncodeWord(const std::string& word, const CodeWord& code_word) {
+      if (PhraseMap::IsPhrase(word)) {
+        phrase_map_.Add(word, code_word);
+      } else {
+        encode_map_.Add(word, code_word);
+      }
+    }
+    void AddDecodeWord(const std::string& word) {
+      check(word.length() <= kMaxWordLen);
+      decode_words_.push_back(DecodeWord{ static_cast<uint32_t>(decode_chars_.size()), static_cast<uint32_t>(word.length()) });
+      decode_chars_.insert(decode_chars_.end(), word.begin(), word.end());
+    }
+    // Number of word chars at the start of ptr, up to max_len.
+    ALWAYS_INLINE size_t WordLength(const uint8_t* ptr, size_t max_len) const {
+      size_t len = 0;
+      const __m128i case_bit = _mm_set1_epi8(0x20);
+      const __m128i lower_a = _mm_set1_epi8('a');
+      const __m128i alpha_range = _mm_set1_epi8('z' - 'a');
+      for (; len + sizeof(__m128i) <= max_len; len += sizeof(__m128i)) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + len));
+        // Letters map to 0..25 after folding the case and subtracting 'a'.
+        const __m128i alpha_off = _mm_sub_epi8(_mm_or_si128(v, case_bit), lower_a);
+        const __m128i alpha = _mm_cmpeq_epi8(_mm_subs_epu8(alpha_off, alpha_range), _mm_setzero_si128());
+        // High bit set bytes are word chars too.
+        const uint32_t word_mask = static_cast<uint32_t>(_mm_movemask_epi8(alpha) | _mm_movemask_epi8(v));
+        if (word_mask != 0xFFFFu) {
+          return len + CountTrailingZeros(~word_mask);
+        }
+      }
+      while (len < max_len && is_word_char_[ptr[len]]) {
+        ++len;
+      }
+      return len;
     }
     virtual void forwardFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
       uint8_t* in_ptr = in;
@@ -618,12 +1051,18 @@ public:
       }
       while (in_ptr < in_limit && out_ptr + 5 < out_limit) {
         if (!is_word_char_[last_char_]) {
+          size_t phrase_len = 0;
+          const CodeWord* phrase_code = phrase_map_.Find(in_ptr, in_limit - in_ptr, is_word_char_, &phrase_len);
+          if (phrase_code != nullptr) {
+            out_ptr = WriteCodeWord(out_ptr, *phrase_code);
+            in_ptr += phrase_len;
+            // The reverse filter only expands code words after a non word char.
+            last_char_ = in_ptr[-1];
+            continue;
+          }
           if (is_word_char_[*in_ptr]) {
             // Calculate maximum word length.
-            size_t word_len = 0;
-            while (word_len < kMaxWordLen && in_ptr + word_len < in_limit && is_word_char_[in_ptr[word_len]]) {
-              ++word_len;
-            }
+            const size_t word_len = WordLength(in_ptr, std::min(kMaxWordLen, static_cast<size_t>(in_limit - in_ptr)));
             if (in_ptr + word_len >= in_limit && word_len != in_limit - in) {
               // If the word is all the remaining chars and not the whole string, then it may be a prefix.
               break;
@@ -633,16 +1072,18 @@ public:
             bool next_word = false;
             const size_t max_out = static_cast<size_t>(out_limit - out_ptr);
             const size_t min_len = kSupportPrefix ? std::min(std::max(word_len, kMinWordLen), static_cast<size_t>(6)) : word_len;
+            // The code words are lower case, words with other capitalizations can't match.
+            uint8_t lower_word[kMaxWordLen];
+            for (size_t i = 0; i < word_len; ++i) {
+              lower_word[i] = static_cast<uint8_t>(MakeLowerCase(in_ptr[i]));
+            }
             if (word_len <= kMaxWordLen) {
               for (size_t cur_len = word_len; cur_len >= min_len; --cur_len) {
                 WordCC cc = GetWordCase(in_ptr, cur_len);
-                std::string word(in_ptr, in_ptr + cur_len);
-                if (cc == kWordCCAll) {
-                  for (auto& c : word) c = MakeLowerCase(c);
-                } else if (cc == kWordCCFirstChar) {
-                  word[0] = MakeLowerCase(word[0]);
+                if (cc == kWordCCInvalid) {
+                  continue;
                 }
-                const EncodeMap::Entry* entry = encode_map_.Find(word);
+                const EncodeMap::Entry* entry = encode_map_.Find(lower_word, cur_len);
                 if (entry != nullptr) {
                   if (cc == kWordCCAll) {
                     *(out_ptr++) = static_cast<uint8_t>(escape_cap_word_);
@@ -656,12 +1097,7 @@ public:
                     // *(out_ptr++) = static_cast<uint8_t>(escape_cap_first_);
                     // if (kStats) ++escape_count_first_;
                   }
-                  auto& code_word = entry->code_word;
-                  const auto num_bytes = code_word.numBytes();
-                  dcheck(num_bytes >= 1 && num_bytes <= 3);
-                  *(out_ptr++) = code_word.byte1();
-                  if (num_bytes > 1) *(out_ptr++) = static_cast<uint8_t>(code_word.byte2());
-                  if (num_bytes > 2) *(out_ptr++) = static_cast<uint8_t>(code_word.byte3());
+                  out_ptr = WriteCodeWord(out_ptr, entry->code_word);
                   in_ptr += cur_len;
                   last_char_ = 'a';
                   next_word = true;
@@ -675,21 +1111,17 @@ public:
             if (word_len < max_out) {
               WordCC cc = GetWordCase(in_ptr, word_len);
               last_char_ = 'a';
-              std::string word(in_ptr, in_ptr + word_len);
-              size_t upper_count = 0;
               if (cc == kWordCCAll) {
-                for (auto& c : word) c = MakeLowerCase(c);
                 *(out_ptr++) = static_cast<uint8_t>(escape_cap_word_);
                 if (kStats) ++escape_count_word_;
-                memcpy(out_ptr, &word[0], word_len);
+                memcpy(out_ptr, lower_word, word_len);
                 in_ptr += word_len;
                 out_ptr += word_len;
                 break;
               } else if (cc == kWordCCFirstChar) {
-                word[0] = MakeLowerCase(word[0]);
                 *(out_ptr++) = static_cast<uint8_t>(escape_cap_first_);
                 if (kStats) ++escape_count_first_;
-                memcpy(out_ptr, &word[0], word_len);
+                memcpy(out_ptr, lower_word, word_len);
                 in_ptr += word_len;
                 out_ptr += word_len;
                 break;
@@ -736,24 +1168,29 @@ public:
               c = *(in_ptr++);
             }
             if (c >= word1bstart) {
-              std::string* word;
+              size_t word_idx;
               if (c < word2bstart) {
-                word = &words1b[c - word1bstart];
+                word_idx = c - word1bstart;
               } else if (c < word3bstart) {
                 int c2 = *(in_ptr++);
                 assert(c2 >= 128);
-                word = &words2b[(c - word2bstart) * 128 + c2 - start_byte];
+                word_idx = words2b_idx_ + (c - word2bstart) * 128 + c2 - start_byte;
               } else {
                 assert(c >= word3bstart);
                 int c2 = *(in_ptr++);
                 int c3 = *(in_ptr++);
                 assert(c2 >= start_byte);
                 assert(c3 >= start_byte);
-                word = &words3b[(c - word3bstart) * 128 * 128 + (c2 - start_byte) * 128 + c3 - start_byte];
+                word_idx = words3b_idx_ + (c - word3bstart) * 128 * 128 + (c2 - start_byte) * 128 + c3 - start_byte;
+              }
+              const DecodeWord& word = decode_words_[word_idx];
+              const size_t word_len = word.length;
+              // May write past the word, there is room for kMaxWordLen bytes.
+              const uint8_t* word_start = &decode_chars_[word.offset];
+              for (size_t i = 0; i < word_len; i += sizeof(__m128i)) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out_ptr + i),
+                                 _mm_loadu_si128(reinterpret_cast<const __m128i*>(word_start + i)));
               }
-              const size_t word_len = word->length();
-              auto* word_start = &word->operator[](0);
-              std::copy(word_start, word_start + word_len, out_ptr);
               const size_t capital_c = all_cap ? word_len : static_cast<size_t>(first_cap);
               for (size_t i = 0; i < capital_c; ++i) {
                 out_ptr[i] = MakeUpperCase(out_ptr[i]);
@@ -24,6 +24,7 @@
 #ifndef _ENTROPY_HPP_
 #define _ENTROPY_HPP_
 
+#include <algorithm>
 #include <cmath>
 
 template <const uint32_t shift = 12, const uint32_t fp_shift_ = 8>
@@ -35,10 +36,15 @@ public:
   SymbolCostTable() {
     auto factor = double(1 << fp_shift);
     for (uint32_t i = 0;i < pmax;++i) {
-      log2_table[i] = int(-log(double(i) / double(pmax)) / log(2.0) * factor);
+      log2_table[i] = int(-log(double(std::max(i, 1u)) / double(pmax)) / log(2.0) * factor);
     }
   }
 
+  static const SymbolCostTable& Shared() {
+    static const SymbolCostTable table;
+    return table;
+  }
+
   inline uint32_t cost(uint32_t p, uint32_t bit) const {
     if (bit == 1) {
       p = pmax - 1 - p;
@@ -47,4 +53,20 @@ public:
   }
 };
 
+// Order 0 entropy of a histogram in bits per symbol.
+template <typename T>
+double Order0Entropy(const T* counts, size_t num_symbols) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < num_symbols; ++i) {
+    total += counts[i];
+  }
+  double bits = 0.0;
+  for (size_t i = 0; i < num_symbols; ++i) {
+    if (counts[i] != 0) {
+      bits += static_cast<double>(counts[i]) * std::log2(static_cast<double>(total) / static_cast<double>(counts[i]));
+    }
+  }
+  return total != 0 ? bits / static_cast<double>(total) : 0.0;
+}
+
 #endif
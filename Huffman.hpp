@@ -268,27 +268,30 @@ public:
     work.push_back(tree);
 
     std::map<TTree*, uint32_t> tree_map;
-    uint32_t cur_state = start_state, cur_state_leaf = cur_state + 0x100;
-    bool state_available[256];
-    for (auto& b : state_available) b = true;
-
-    // Calculate tree -> state map.
-    // TODO: Improve layout to maximize number of cache misses to 2 per byte.
-    do {
-      std::vector<TTree*> temp;
-      for (uint32_t i = 0; i < work.size(); ++i) {
-        auto* cur_tree = work[i];
-        if (cur_tree->IsLeaf()) {
-          tree_map[cur_tree] = cur_tree->Alphabet() | 0x100;
-        } else {
-          state_available[cur_state] = false;
-          tree_map[cur_tree] = cur_state++;
-          temp.push_back(cur_tree->A());
-          temp.push_back(cur_tree->B());
+    uint32_t cur_state = start_state;
+
+    // Calculate tree -> state map. The states are numbered in groups of 4 levels (at most 15
+    // states) like the nibbles of a byte, so that the states visited by a short code are in
+    // a few consecutive groups.
+    for (size_t group = 0; group < work.size(); ++group) {
+      std::vector<TTree*> level(1, work[group]);
+      for (size_t depth = 0; depth < 4 && !level.empty(); ++depth) {
+        std::vector<TTree*> next_level;
+        for (auto* cur_tree : level) {
+          if (cur_tree->IsLeaf()) {
+            tree_map[cur_tree] = cur_tree->Alphabet() | 0x100;
+          } else {
+            tree_map[cur_tree] = cur_state++;
+            next_level.push_back(cur_tree->A());
+            next_level.push_back(cur_tree->B());
+          }
         }
+        level.swap(next_level);
       }
-      work.swap(temp);
-    } while (!work.empty());
+      // The remaining subtrees start new groups.
+      work.insert(work.end(), level.begin(), level.end());
+    }
+    assert(cur_state <= 256);
 
     // Calculate transitions.
     for (auto it : tree_map) {
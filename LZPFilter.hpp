@@ -0,0 +1,188 @@
+/*	MCM file compressor
+
+  Copyright (C) 2015, Google Inc.
+  Authors: Mathieu Chartier
+
+  LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LZP_FILTER_HPP_
+#define _LZP_FILTER_HPP_
+
+#include <memory>
+
+#include "Filter.hpp"
+
+// Removes long predicted runs before CM sees them. The prediction for each position is where the
+// last kOrder bytes were last seen, runs of at least kMinMatch predicted bytes are replaced by an
+// escape and the length.
+// Encoding format:
+// FE <len - kMinMatch + 1 as 7 bit groups, high bit set if more follow> -> predicted run
+// FE 00 -> FE
+// <other> -> <other>
+class LZPFilter : public ByteStreamFilter<16 * KB, 16 * KB> {
+  static const uint8_t kEscape = 0xFE;  // Not present in UTF-8.
+  static const size_t kOrder = 6;
+  static const size_t kMinMatch = 32;
+  // Bounds the output of one token so that the reverse filter always has room for it.
+  static const size_t kMaxMatch = 4 * KB;
+  static const size_t kMaxTokenSize = 3;
+  static const size_t kWindowBits = 24;
+  static const size_t kHashBits = 20;
+public:
+  explicit LZPFilter(Stream* stream)
+    : ByteStreamFilter(stream), window_(1u << kWindowBits), hash_table_(1u << kHashBits),
+      pos_(0), last_bytes_(0), pred_(0), match_count_(0), match_bytes_(0) {
+  }
+  virtual void forwardFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+    uint8_t* const start_out = out;
+    uint8_t* const out_limit = out + *out_count;
+    const uint8_t* const start_in = in;
+    const uint8_t* const in_limit = in + *in_count;
+    while (in < in_limit && out + kMaxTokenSize <= out_limit) {
+      const size_t pred = Predicted();
+      size_t len = 0;
+      if (pred != kNoPrediction) {
+        const size_t max_len = std::min(static_cast<size_t>(in_limit - in), kMaxMatch);
+        // The prediction may overlap the bytes being matched.
+        for (; len < max_len; ++len) {
+          const size_t p = pred + len;
+          const uint8_t c = p < pos_ ? window_[p & kWindowMask] : in[p - pos_];
+          if (c != in[len]) break;
+        }
+      }
+      if (len >= kMinMatch) {
+        *out++ = kEscape;
+        size_t code = len - kMinMatch + 1;
+        for (; code >= 0x80; code >>= 7) {
+          *out++ = static_cast<uint8_t>(code | 0x80);
+        }
+        *out++ = static_cast<uint8_t>(code);
+        for (size_t i = 0; i < len; ++i) {
+          Update(in[i]);
+        }
+        in += len;
+        ++match_count_;
+        match_bytes_ += len;
+      } else {
+        const uint8_t c = *in++;
+        *out++ = c;
+        if (c == kEscape) {
+          *out++ = 0;
+        }
+        Update(c);
+      }
+    }
+    *out_count = out - start_out;
+    *in_count = in - start_in;
+  }
+  virtual void reverseFilter(uint8_t* out, size_t* out_count, uint8_t* in, size_t* in_count) {
+    uint8_t* const start_out = out;
+    uint8_t* const out_limit = out + *out_count;
+    const uint8_t* const start_in = in;
+    const uint8_t* const in_limit = in + *in_count;
+    while (in < in_limit && out + kMaxMatch <= out_limit) {
+      if (*in != kEscape) {
+        const uint8_t c = *in++;
+        *out++ = c;
+        Update(c);
+        continue;
+      }
+      // Wait for the rest of the token.
+      uint8_t* ptr = in + 1;
+      size_t code = 0;
+      size_t shift = 0;
+      bool done = false;
+      while (ptr < in_limit) {
+        const uint8_t b = *ptr++;
+        code |= static_cast<size_t>(b & 0x7F) << shift;
+        shift += 7;
+        if ((b & 0x80) == 0) {
+          done = true;
+          break;
+        }
+      }
+      if (!done) {
+        break;
+      }
+      in = ptr;
+      if (code == 0) {
+        *out++ = kEscape;
+        Update(kEscape);
+        continue;
+      }
+      const size_t len = code + kMinMatch - 1;
+      check(len <= kMaxMatch);
+      const size_t pred = Predicted();
+      check(pred != kNoPrediction);
+      for (size_t i = 0; i < len; ++i) {
+        const uint8_t c = window_[(pred + i) & kWindowMask];
+        *out++ = c;
+        Update(c);
+      }
+    }
+    *out_count = out - start_out;
+    *in_count = in - start_in;
+  }
+  static uint32_t getMaxExpansion() {
+    return 2;
+  }
+  void dumpInfo() const {
+    std::cout << std::endl << "LZP: " << match_count_ << " matches " << match_bytes_ << " bytes" << std::endl;
+  }
+
+private:
+  static const size_t kWindowMask = (1u << kWindowBits) - 1;
+  static const size_t kNoPrediction = static_cast<size_t>(-1);
+
+  ALWAYS_INLINE size_t HashIndex() const {
+    const uint64_t ctx = last_bytes_ & ((static_cast<uint64_t>(1) << (kOrder * 8)) - 1);
+    return static_cast<size_t>((ctx * 0x9E3779B97F4A7C15ULL) >> (64 - kHashBits));
+  }
+
+  // Position where the current context was last seen, only if it is still in the window.
+  ALWAYS_INLINE size_t Predicted() const {
+    const uint32_t dist = static_cast<uint32_t>(pos_) - pred_;
+    if (pred_ == 0 || dist >= window_.size() - kMaxMatch) {
+      return kNoPrediction;
+    }
+    return pos_ - dist;
+  }
+
+  ALWAYS_INLINE void Update(uint8_t c) {
+    window_[pos_++ & kWindowMask] = c;
+    last_bytes_ = (last_bytes_ << 8) | c;
+    if (pos_ >= kOrder) {
+      auto& slot = hash_table_[HashIndex()];
+      pred_ = slot;
+      slot = static_cast<uint32_t>(pos_);
+    }
+  }
+
+  std::vector<uint8_t> window_;
+  std::vector<uint32_t> hash_table_;
+  size_t pos_;
+  uint64_t last_bytes_;
+  // Previous position of the current context.
+  uint32_t pred_;
+
+  size_t match_count_;
+  size_t match_bytes_;
+};
+
+#endif
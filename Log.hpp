@@ -109,6 +109,17 @@ public:
     }
   }
 
+  // The tables only depend on the template arguments, build them once per process.
+  static const ss_table& Shared() {
+    struct Built : public ss_table {
+      Built() {
+        this->build(nullptr);
+      }
+    };
+    static const Built table;
+    return table;
+  }
+
   const T* getStretchPtr() const {
     return stretch_table_;
   }
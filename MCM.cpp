@@ -78,6 +78,8 @@ public:
     kModeDecompress,
     // List & other
     kModeList,
+    // Build prime data for -prime= from sample files.
+    kModeTrain,
   };
   Mode mode = kModeUnknown;
   bool opt_mode = false;
@@ -89,6 +91,9 @@ public:
   std::vector<FileInfo> files;
   const std::string kDictArg = "-dict=";
   const std::string kOutDictArg = "-out-dict=";
+  const std::string kCMProfileArg = "-cm-profile=";
+  const std::string kPrimeArg = "-prime=";
+  const std::string kCacheArg = "-cache=";
   std::string dict_file;
 
   int usage(const std::string& name) {
@@ -97,11 +102,25 @@ public:
       << "Caution: Experimental, use only for testing!" << std::endl
       << "Usage: " << name << " [commands] [options] <infile|dir> <outfile>(default infile.mcm)" << std::endl
       << "Options: d for decompress" << std::endl
-      << "-{t|f|m|h|x}{1 .. 11} compression option" << std::endl
-      << "t is turbo, f is fast, m is mid, h is high, x is max (default " << CompressionOptions::kDefaultLevel << ")" << std::endl
+      << "-{t|f|m|h|x|u}{1 .. 11} compression option" << std::endl
+      << "t is turbo, f is fast, m is mid, h is high, x is max, u is ultra (default " << CompressionOptions::kDefaultLevel << ")" << std::endl
       << "0 .. 11 specifies memory with 32mb .. 5gb per thread (default " << CompressionOptions::kDefaultMemUsage << ")" << std::endl
       << "10 and 11 are only supported on 64 bits" << std::endl
       << "-test tests the file after compression is done" << std::endl
+      << "-models=auto picks the model set per block from a trial compression" << std::endl
+      << "-cache=<mb> keeps up to mb of input in memory after analysis instead of reading it again (default 0)" << std::endl
+      << "-analyze=sample classifies files over " << Analyzer::kMinSampledLength / MB << "mb from samples (default full)" << std::endl
+      << "-mixer=16 uses mixers with 16 bit weights for h and x (default 32)" << std::endl
+      << "-coder=range7|range64 arithmetic coder of the CM levels (default range64 for t and f)" << std::endl
+      << "-huffman=true codes text bytes as huffman codes in the CM levels (default false)" << std::endl
+      << "-runs=false codes runs of the same byte with CM instead of the run model (default true)" << std::endl
+      << "-longmatch=false disables the long range match model of the h, x and u levels (default true)" << std::endl
+      << "-phrases=true adds frequent phrases to the text dictionary, for templated text and logs (default false)" << std::endl
+      << "-cm-profile=<file> replaces the CM models and learn rates, see CMProfileSet::Load" << std::endl
+      << "-filter=lzp removes long repeats before CM, for highly redundant data" << std::endl
+      << "-filter=trial picks the filter per block from a trial compression" << std::endl
+      << "-prime=<file> primes the CM levels with data from train, also needed to decompress" << std::endl
+      << "train <infile|dir> <outfile> writes prime data from sample files" << std::endl
       // << "-b <mb> specifies block size in MB" << std::endl
       // << "-t <threads> the number of threads to use (decompression requires the same number of threads" << std::endl
       << "Examples:" << std::endl
@@ -129,6 +148,7 @@ public:
       else if (arg == "a") parsed_mode = kModeAdd;
       else if (arg == "e") parsed_mode = kModeExtract;
       else if (arg == "x") parsed_mode = kModeExtractAll;
+      else if (arg == "train") parsed_mode = kModeTrain;
       if (parsed_mode != kModeUnknown) {
         if (mode != kModeUnknown) {
           std::cerr << "Multiple commands specified" << std::endl;
@@ -152,14 +172,52 @@ public:
       else if (arg == "-filter=none") options_.filter_type_ = kFilterTypeNone;
       else if (arg == "-filter=dict") options_.filter_type_ = kFilterTypeDict;
       else if (arg == "-filter=x86") options_.filter_type_ = kFilterTypeX86;
+      else if (arg == "-filter=lzp") options_.filter_type_ = kFilterTypeLZP;
       else if (arg == "-filter=auto") options_.filter_type_ = kFilterTypeAuto;
+      else if (arg == "-filter=trial") options_.filter_type_ = kFilterTypeTrial;
       else if (arg.substr(0, std::min(kDictArg.length(), arg.length())) == kDictArg) {
         options_.dict_file_ = arg.substr(kDictArg.length());
       } else if (arg.substr(0, std::min(kOutDictArg.length(), arg.length())) == kOutDictArg) {
         options_.out_dict_file_ = arg.substr(kOutDictArg.length());
+      } else if (arg.substr(0, std::min(kCMProfileArg.length(), arg.length())) == kCMProfileArg) {
+        auto profile_set = std::make_shared<cm::CMProfileSet>();
+        if (!profile_set->Load(arg.substr(kCMProfileArg.length()), std::cerr)) {
+          return 4;
+        }
+        options_.cm_profile_set_ = profile_set;
+      } else if (arg.substr(0, std::min(kPrimeArg.length(), arg.length())) == kPrimeArg) {
+        auto prime = std::make_shared<PrimeData>();
+        if (!prime->Load(arg.substr(kPrimeArg.length()), std::cerr)) {
+          return 4;
+        }
+        options_.prime_ = prime;
       } else if (arg == "-lzp=auto") options_.lzp_type_ = kLZPTypeAuto;
       else if (arg == "-lzp=true") options_.lzp_type_ = kLZPTypeEnable;
       else if (arg == "-lzp=false") options_.lzp_type_ = kLZPTypeDisable;
+      else if (arg == "-analyze=sample") options_.sample_analysis_ = true;
+      else if (arg == "-analyze=full") options_.sample_analysis_ = false;
+      else if (arg.substr(0, std::min(kCacheArg.length(), arg.length())) == kCacheArg) {
+        std::istringstream iss(arg.substr(kCacheArg.length()));
+        uint64_t cache_size = 0;
+        if (!(iss >> cache_size)) {
+          return usage(program);
+        }
+        options_.cache_size_ = cache_size * MB;
+      }
+      else if (arg == "-models=auto") options_.auto_models_ = true;
+      else if (arg == "-models=fixed") options_.auto_models_ = false;
+      else if (arg == "-mixer=16") options_.mixer16_ = true;
+      else if (arg == "-mixer=32") options_.mixer16_ = false;
+      else if (arg == "-coder=range7") options_.coder_type_ = kCoderTypeRange7;
+      else if (arg == "-coder=range64") options_.coder_type_ = kCoderTypeRange64;
+      else if (arg == "-huffman=true") options_.huffman_ = true;
+      else if (arg == "-huffman=false") options_.huffman_ = false;
+      else if (arg == "-runs=true") options_.run_bypass_ = true;
+      else if (arg == "-runs=false") options_.run_bypass_ = false;
+      else if (arg == "-longmatch=true") options_.long_match_ = true;
+      else if (arg == "-longmatch=false") options_.long_match_ = false;
+      else if (arg == "-phrases=true") options_.dict_phrases_ = true;
+      else if (arg == "-phrases=false") options_.dict_phrases_ = false;
       else if (arg == "-b") {
         if (i + 1 >= argc) {
           return usage(program);
@@ -179,6 +237,7 @@ public:
         else if (arg[1] == 'm') options_.comp_level_ = kCompLevelMid;
         else if (arg[1] == 'h') options_.comp_level_ = kCompLevelHigh;
         else if (arg[1] == 'x') options_.comp_level_ = kCompLevelMax;
+        else if (arg[1] == 'u') options_.comp_level_ = kCompLevelUltra;
         else if (arg[1] == 's') options_.comp_level_ = kCompLevelSimple;
         else {
           std::cerr << "Unknown option " << arg << std::endl;
@@ -235,7 +294,7 @@ public:
     }
     const bool single_file_mode =
       mode == kModeCompress || mode == kModeDecompress || mode == kModeSingleTest ||
-      mode == kModeMemTest || mode == kModeOpt || kModeList;
+      mode == kModeMemTest || mode == kModeOpt || mode == kModeTrain || kModeList;
     if (single_file_mode && i < argc) {
       std::string in_file, out_file;
       // Read in file and outfile.
@@ -252,7 +311,7 @@ public:
       if (mode == kModeMemTest) {
         // No out file for memtest.
         files.push_back(FileInfo(trimDir(in_file)));
-      } else if (mode == kModeCompress || mode == kModeSingleTest || mode == kModeOpt) {
+      } else if (mode == kModeCompress || mode == kModeSingleTest || mode == kModeOpt || mode == kModeTrain) {
         archive_file = FileInfo(trimDir(out_file));
         files.push_back(FileInfo(trimDir(in_file)));
       } else {
@@ -509,9 +568,12 @@ int main(int argc, char* argv[]) {
           return 1;
         }
         Archive archive(&fout);
+        archive.Options().prime_ = options.options_.prime_;
         archive.list();
         std::cout << "Verifying archive decompression" << std::endl;
-        archive.decompress("", true);
+        if (!archive.decompress("", true)) {
+          return 1;
+        }
       }
     }
     break;
@@ -536,8 +598,8 @@ int main(int argc, char* argv[]) {
       std::cerr << "Attempting to open non mcm compatible file" << std::endl;
       return 1;
     }
-    if (!header.isSameVersion()) {
-      std::cerr << "Attempting to open old version " << header.majorVersion() << "." << header.minorVersion() << std::endl;
+    if (!header.isSupportedVersion()) {
+      std::cerr << "Attempting to open unsupported version " << header.majorVersion() << "." << header.minorVersion() << std::endl;
       return 1;
     }
     archive.list();
@@ -561,16 +623,38 @@ int main(int argc, char* argv[]) {
       std::cerr << "Attempting to decompress non archive file" << std::endl;
       return 1;
     }
-    if (!header.isSameVersion()) {
-      std::cerr << "Attempting to decompress other version " << header.majorVersion() << "." << header.minorVersion() << std::endl;
+    if (!header.isSupportedVersion()) {
+      std::cerr << "Attempting to decompress unsupported version " << header.majorVersion() << "." << header.minorVersion() << std::endl;
       return 1;
     }
+    archive.Options().prime_ = options.options_.prime_;
     // archive.decompress(options.files.back().getName());
-    archive.decompress("");
+    if (!archive.decompress("")) {
+      return 1;
+    }
     fin.close();
     // Decompress the single file in the archive to the output out.
     break;
   }
+  case Options::kModeTrain: {
+    printHeader();
+    FileList files;
+    for (const auto& f : options.files) {
+      files.push_back(f);
+      if (f.isDir()) {
+        files.addDirectoryRec(f.getName());
+      }
+    }
+    PrimeData prime;
+    prime.Train(files);
+    const auto out_file = options.archive_file.getName();
+    if (!prime.Save(out_file)) {
+      std::cerr << "Error writing: " << out_file << std::endl;
+      return 1;
+    }
+    std::cout << "Wrote " << formatNumber(prime.Data().size()) << " bytes of prime data to " << out_file << std::endl;
+    break;
+  }
   case Options::kModeExtract: {
     // Extract a single file from multi file archive.
     break;
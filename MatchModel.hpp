@@ -1,8 +1,24 @@
 #ifndef _MATCH_MODEL_HPP_
 #define _MATCH_MODEL_HPP_
 
+#include "CyclicBuffer.hpp"
 #include "Memory.hpp"
 
+// Length of the common suffix of the bytes before a and before b, at most max_len. Compares 16
+// bytes at a time, the bytes up to max_len rounded up to 16 before a and b must be readable.
+static ALWAYS_INLINE size_t CommonSuffix(const uint8_t* a, const uint8_t* b, size_t max_len) {
+  for (size_t len = 0; len < max_len; len += 16) {
+    const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a - len - 16));
+    const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b - len - 16));
+    const uint32_t diff = ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb))) & 0xFFFF;
+    if (diff != 0) {
+      // The highest differing byte is the closest to the end.
+      return std::min(len + __builtin_clz(diff) - 16, max_len);
+    }
+  }
+  return max_len;
+}
+
 template <typename Model>
 class MatchModel {
 public:
@@ -105,11 +121,19 @@ public:
     len = 0;
   }
 
+  // Use a match found by another model, the caller supplies the expected char.
+  ALWAYS_INLINE void SetExternalMatch(size_t match_len) {
+    len = std::min(match_len, cur_max_match);
+  }
+
   ALWAYS_INLINE void setCtx(size_t ctx) {
     model_base = &models[ctx * num_length_models_];
   }
 
+  // The 4 byte check reads the buffer padding at the wrap point, archives depend on that so the
+  // buffer must not be mirrored.
   NO_INLINE void search(Buffer& buffer, size_t spos) {
+    dcheck(!buffer.Mirrored());
     // Reverse match.
     size_t blast = buffer.Pos() - 1;
     size_t len = sizeof(uint32_t);
@@ -196,4 +220,106 @@ public:
   }
 };
 
+// Match model for repeats further back than the CM history. Keeps its own larger window and only
+// indexes every kStride'th position by a rolling hash of the kMinMatch bytes before it. Lookups
+// happen at every position so a repeat is found at most kStride bytes after it starts.
+class LongMatchModel {
+public:
+  static const size_t kMinMatch = 32;
+  static const size_t kStride = 16;
+  static const size_t kMaxVerify = 64;
+  static const size_t kMaxLen = 0xFFFF;
+private:
+  static const uint32_t kHashMul = 0x2F0B4A13;
+  struct Slot {
+    uint32_t check;
+    uint32_t pos;
+  };
+  CyclicBuffer<uint8_t> buffer_;
+  MemMap table_storage_;
+  Slot* table_ = nullptr;
+  size_t table_shift_ = 0;
+  // Multiplier for the byte leaving the hash window, kHashMul ^ (kMinMatch - 1).
+  uint32_t remove_mul_ = 0;
+  uint32_t hash_ = 0;
+  // Slot for the current position, inserted on the next update so that Find still sees the old
+  // entry.
+  Slot* cur_slot_ = nullptr;
+  bool insert_ = false;
+  size_t match_pos_ = 0;
+  size_t len_ = 0;
+
+public:
+  void resize(size_t window_size, size_t table_size) {
+    buffer_.Resize(window_size, sizeof(uint32_t), /*mirror*/true);
+    check(isPowerOf2(table_size));
+    table_storage_.resize(table_size * sizeof(Slot));
+    table_ = reinterpret_cast<Slot*>(table_storage_.getData());
+    table_shift_ = 32 - bitSize(table_size - 1);
+    remove_mul_ = 1;
+    for (size_t i = 1; i < kMinMatch; ++i) remove_mul_ *= kHashMul;
+  }
+
+  // Call after resize, the window and table are freshly allocated and already zero.
+  void init() {
+    hash_ = 0;
+    cur_slot_ = &table_[0];
+    insert_ = false;
+    match_pos_ = len_ = 0;
+  }
+
+  ALWAYS_INLINE size_t GetLength() const {
+    return len_;
+  }
+
+  ALWAYS_INLINE uint32_t GetExpectedChar() const {
+    return buffer_[match_pos_];
+  }
+
+  ALWAYS_INLINE void update(uint8_t c) {
+    if (insert_) {
+      cur_slot_->check = hash_;
+      cur_slot_->pos = static_cast<uint32_t>(buffer_.Pos());
+    }
+    const uint8_t out = buffer_[buffer_.Pos() - kMinMatch];
+    hash_ = (hash_ - out * remove_mul_) * kHashMul + c;
+    buffer_.Push(c);
+    if (len_ != 0) {
+      if (buffer_[match_pos_] == c) {
+        ++match_pos_;
+        len_ += len_ < kMaxLen;
+      } else {
+        len_ = 0;
+      }
+    }
+    cur_slot_ = &table_[(hash_ * 0x9E3779B1u) >> table_shift_];
+    insert_ = buffer_.Pos() % kStride == 0;
+    Prefetch(cur_slot_);
+  }
+
+  // Look for a match ending at the current position, only call when there is no current match.
+  ALWAYS_INLINE void Find() {
+    dcheck(len_ == 0);
+    if (cur_slot_->check != hash_) {
+      return;
+    }
+    const size_t pos = buffer_.Pos();
+    const size_t dist = static_cast<uint32_t>(pos - cur_slot_->pos);
+    if (dist == 0 || dist + kMaxVerify >= buffer_.Size() || pos < kMinMatch + dist) {
+      return;
+    }
+    const size_t cand = pos - dist;
+    size_t len = 0;
+    if (buffer_.Mirrored()) {
+      len = CommonSuffix(buffer_.Ptr(cand), buffer_.Ptr(pos), kMaxVerify);
+    } else {
+      while (len < kMaxVerify && buffer_[cand - 1 - len] == buffer_[pos - 1 - len]) ++len;
+    }
+    if (len >= kMinMatch) {
+      match_pos_ = cand;
+      len_ = len;
+    }
+  }
+};
+
 #endif
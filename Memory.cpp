@@ -35,6 +35,12 @@
 // TODO: mmap
 #endif
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 MemMap::MemMap() : storage(nullptr), size(0) {
 
 }
@@ -72,6 +78,59 @@ void MemMap::release() {
   }
 }
 
+MirroredMemMap::MirroredMemMap() : base_(nullptr), size_(0) {
+}
+
+MirroredMemMap::~MirroredMemMap() {
+  release();
+}
+
+bool MirroredMemMap::resize(size_t bytes) {
+  release();
+#if defined(__linux__) && defined(SYS_memfd_create)
+  const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  if (bytes == 0 || bytes % page_size != 0) {
+    return false;
+  }
+  // Use the syscall directly, the libc wrapper is only in newer versions.
+  const int fd = static_cast<int>(syscall(SYS_memfd_create, "mcm-ring", 0));
+  if (fd < 0) {
+    return false;
+  }
+  bool success = ftruncate(fd, bytes) == 0;
+  // Reserve the whole range first so that the copies are guaranteed to be consecutive.
+  void* base = success ? mmap(nullptr, bytes * kCopies, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+  success = base != MAP_FAILED;
+  for (size_t i = 0; success && i < kCopies; ++i) {
+    uint8_t* addr = reinterpret_cast<uint8_t*>(base) + i * bytes;
+    success = mmap(addr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == addr;
+  }
+  // The mappings keep the memory alive.
+  close(fd);
+  if (!success) {
+    if (base != MAP_FAILED) {
+      munmap(base, bytes * kCopies);
+    }
+    return false;
+  }
+  base_ = reinterpret_cast<uint8_t*>(base);
+  size_ = bytes;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void MirroredMemMap::release() {
+  if (base_ != nullptr) {
+#ifdef __linux__
+    munmap(base_, size_ * kCopies);
+#endif
+    base_ = nullptr;
+    size_ = 0;
+  }
+}
+
 void MemMap::zero() {
 #ifdef USE_MALLOC
   std::memset(storage, 0, size);
@@ -50,6 +50,30 @@ public:
   virtual ~MemMap();
 };
 
+// Maps the same pages at three consecutive addresses, getData() is the middle copy. Accesses up to
+// getSize() bytes before or after any offset in the middle copy see the ring contents without
+// wrapping. Only supported on Linux with memfd, for page size multiples.
+class MirroredMemMap {
+  static const size_t kCopies = 3;
+  uint8_t* base_;
+  size_t size_;
+public:
+  inline size_t getSize() const {
+    return size_;
+  }
+
+  // Returns false and leaves the map empty if mirroring is not supported.
+  bool resize(size_t bytes);
+  void release();
+
+  inline void* getData() {
+    return base_ != nullptr ? base_ + size_ : nullptr;
+  }
+
+  MirroredMemMap();
+  ~MirroredMemMap();
+};
+
 template <typename T, bool kBigEndian>
 T readBytes(uint8_t* ptr, size_t bytes) {
   T acc = 0;
@@ -25,8 +25,10 @@
 #define _MIXER_HPP_
 
 #include <emmintrin.h>
-#include "Util.hpp"
+#include <new>
 #include "Compressor.hpp"
+#include "Memory.hpp"
+#include "Util.hpp"
 
 
 template <const uint32_t fp_shift = 14>
@@ -177,6 +179,206 @@ private:
   }
 };
 
+// Mixer with 16 bit weights packed in one aligned 32 or 64 byte block so that each mixer is a
+// single cache line, the dot product and the update are done with SSE2. The weights are scaled down
+// by 2^kWeightShift compared to Mixer<int> so that they fit, the arguments of P and Update are
+// otherwise the same.
+template <const uint32_t kWeights>
+class alignas((((kWeights + 7) & ~7u) <= 8) ? 32 : 64) Mixer16 {
+  static const uint32_t kVecWeights = (kWeights + 7) & ~7u;
+  static const uint32_t kVecs = kVecWeights / 8;
+  static_assert(kVecs <= 2, "at most 16 inputs");
+public:
+  static const uint32_t kWeightShift = 2;
+
+  // Each mixer has its own set of weights, padded with zero weights.
+  int16_t w_[kVecWeights];
+
+  // Skew weight.
+  int skew_;
+
+  // Current learn rate.
+  int learn_;
+public:
+  Mixer16() {
+    Init(12);
+  }
+
+  ALWAYS_INLINE static uint32_t NumWeights() {
+    return kWeights;
+  }
+
+  ALWAYS_INLINE int GetLearn() const {
+    return learn_;
+  }
+
+  ALWAYS_INLINE int NextLearn(size_t max_shift) {
+    auto before = learn_;
+    ++learn_;
+    learn_ -= learn_ >> max_shift;
+    return before;
+  }
+
+  ALWAYS_INLINE int GetWeight(uint32_t index) const {
+    assert(index < kWeights);
+    return w_[index];
+  }
+
+  ALWAYS_INLINE void SetWeight(uint32_t index, int weight) {
+    assert(index < kWeights);
+    w_[index] = static_cast<int16_t>(weight);
+  }
+
+  void Init(int prob_shift, int extra = 0) {
+    for (auto& cw : w_) {
+      cw = 0;
+    }
+    for (size_t i = 0; i < kWeights; ++i) {
+      w_[i] = static_cast<int16_t>(((16 + extra) << prob_shift) / kWeights / 16);
+    }
+    skew_ = 0;
+    learn_ = 0;
+  }
+
+  // Inputs are stretched probabilities, they must fit in 12 bits.
+  ALWAYS_INLINE int P(
+    int prob_shift,
+    int p0 = 0, int p1 = 0, int p2 = 0, int p3 = 0, int p4 = 0, int p5 = 0, int p6 = 0, int p7 = 0,
+    int p8 = 0, int p9 = 0, int p10 = 0, int p11 = 0, int p12 = 0, int p13 = 0, int p14 = 0, int p15 = 0) const {
+    const __m128i* w = reinterpret_cast<const __m128i*>(w_);
+    __m128i dp = _mm_madd_epi16(_mm_load_si128(w), _mm_set_epi16(p7, p6, p5, p4, p3, p2, p1, p0));
+    if (kVecs > 1) {
+      dp = _mm_add_epi32(dp, _mm_madd_epi16(_mm_load_si128(w + 1),
+        _mm_set_epi16(p15, p14, p13, p12, p11, p10, p9, p8)));
+    }
+    dp = _mm_add_epi32(dp, _mm_shuffle_epi32(dp, shuffle<1, 0, 3, 2>::value));
+    dp = _mm_add_epi32(dp, _mm_shuffle_epi32(dp, shuffle<2, 3, 0, 1>::value));
+    return (_mm_cvtsi128_si32(dp) + skew_) >> prob_shift;
+  }
+
+  ALWAYS_INLINE bool Update(int pr, uint32_t bit,
+    uint32_t prob_shift = 12, int limit = 24, int delta_round = 250, int skew_learn = 1,
+    int learn_mult = 31, size_t shift = 16,
+    int p0 = 0, int p1 = 0, int p2 = 0, int p3 = 0, int p4 = 0, int p5 = 0, int p6 = 0, int p7 = 0,
+    int p8 = 0, int p9 = 0, int p10 = 0, int p11 = 0, int p12 = 0, int p13 = 0, int p14 = 0, int p15 = 0) {
+    const int64_t base_learn = static_cast<int64_t>(bit << prob_shift) - pr;
+    const int64_t err = base_learn * learn_mult;
+    const bool ret = err < static_cast<int64_t>(-delta_round) || err > static_cast<int64_t>(delta_round);
+    if (ret) {
+      // Inputs are scaled up by 16 to use all 16 bits, mulhi then computes
+      // (p << 4) * (err >> (shift + kWeightShift - 12)) >> 16 == p * err >> (shift + kWeightShift).
+      const int64_t serr = std::max(std::min(err >> (shift + kWeightShift - 12), static_cast<int64_t>(32767)),
+        static_cast<int64_t>(-32768));
+      const __m128i verr = _mm_set1_epi16(static_cast<int16_t>(serr));
+      __m128i* w = reinterpret_cast<__m128i*>(w_);
+      __m128i probs = _mm_slli_epi16(_mm_set_epi16(p7, p6, p5, p4, p3, p2, p1, p0), 4);
+      _mm_store_si128(w, _mm_adds_epi16(_mm_load_si128(w), _mm_mulhi_epi16(probs, verr)));
+      if (kVecs > 1) {
+        probs = _mm_slli_epi16(_mm_set_epi16(p15, p14, p13, p12, p11, p10, p9, p8), 4);
+        _mm_store_si128(w + 1, _mm_adds_epi16(_mm_load_si128(w + 1), _mm_mulhi_epi16(probs, verr)));
+      }
+      skew_ += static_cast<int>((err << skew_learn) >> kWeightShift);
+      learn_ += learn_ < limit;
+    }
+    return ret;
+  }
+};
+
+// First layer of a two layer network, kCount mixers which mix the same inputs. The generic version
+// mixes them one at a time.
+template <typename Mixer, size_t kCount>
+class MixerLayer {
+public:
+  ALWAYS_INLINE static void P(Mixer* const* mixers, int prob_shift, int* out,
+    int p0 = 0, int p1 = 0, int p2 = 0, int p3 = 0, int p4 = 0, int p5 = 0, int p6 = 0, int p7 = 0,
+    int p8 = 0, int p9 = 0, int p10 = 0, int p11 = 0, int p12 = 0, int p13 = 0, int p14 = 0, int p15 = 0) {
+    for (size_t i = 0; i < kCount; ++i) {
+      out[i] = mixers[i]->P(prob_shift, p0, p1, p2, p3, p4, p5, p6, p7, p8, p9, p10, p11, p12, p13, p14, p15);
+    }
+  }
+
+  // Each mixer learns from its own prediction prs[i] with its own learn rate.
+  ALWAYS_INLINE static void Update(Mixer* const* mixers, const int* prs, uint32_t bit,
+    uint32_t prob_shift, int limit, int delta_round, int skew_learn, const int* learn_mults, size_t shift,
+    int p0 = 0, int p1 = 0, int p2 = 0, int p3 = 0, int p4 = 0, int p5 = 0, int p6 = 0, int p7 = 0,
+    int p8 = 0, int p9 = 0, int p10 = 0, int p11 = 0, int p12 = 0, int p13 = 0, int p14 = 0, int p15 = 0) {
+    for (size_t i = 0; i < kCount; ++i) {
+      mixers[i]->Update(prs[i], bit, prob_shift, limit, delta_round, skew_learn, learn_mults[i], shift,
+        p0, p1, p2, p3, p4, p5, p6, p7, p8, p9, p10, p11, p12, p13, p14, p15);
+    }
+  }
+};
+
+// The input vectors are packed once for all the mixers and the dot products of up to 4 mixers are
+// summed together, one lane per mixer.
+template <const uint32_t kWeights, size_t kCount>
+class MixerLayer<Mixer16<kWeights>, kCount> {
+  typedef Mixer16<kWeights> Mixer;
+  static const uint32_t kVecs = (kWeights + 7) / 8;
+  static_assert(kCount <= 4, "one lane per mixer");
+public:
+  ALWAYS_INLINE static void P(Mixer* const* mixers, int prob_shift, int* out,
+    int p0 = 0, int p1 = 0, int p2 = 0, int p3 = 0, int p4 = 0, int p5 = 0, int p6 = 0, int p7 = 0,
+    int p8 = 0, int p9 = 0, int p10 = 0, int p11 = 0, int p12 = 0, int p13 = 0, int p14 = 0, int p15 = 0) {
+    if (kCount == 1) {
+      out[0] = mixers[0]->P(prob_shift, p0, p1, p2, p3, p4, p5, p6, p7, p8, p9, p10, p11, p12, p13, p14, p15);
+      return;
+    }
+    const __m128i in0 = _mm_set_epi16(p7, p6, p5, p4, p3, p2, p1, p0);
+    const __m128i in1 = _mm_set_epi16(p15, p14, p13, p12, p11, p10, p9, p8);
+    __m128i dp[4];
+    int skew[4] = {};
+    for (size_t i = 0; i < 4; ++i) {
+      dp[i] = _mm_setzero_si128();
+      if (i < kCount) {
+        const __m128i* w = reinterpret_cast<const __m128i*>(mixers[i]->w_);
+        dp[i] = _mm_madd_epi16(_mm_load_si128(w), in0);
+        if (kVecs > 1) {
+          dp[i] = _mm_add_epi32(dp[i], _mm_madd_epi16(_mm_load_si128(w + 1), in1));
+        }
+        skew[i] = mixers[i]->skew_;
+      }
+    }
+    // Transpose and add, lane i ends up with the sum of dp[i].
+    const __m128i s01 = _mm_add_epi32(_mm_unpacklo_epi32(dp[0], dp[1]), _mm_unpackhi_epi32(dp[0], dp[1]));
+    const __m128i s23 = _mm_add_epi32(_mm_unpacklo_epi32(dp[2], dp[3]), _mm_unpackhi_epi32(dp[2], dp[3]));
+    __m128i sums = _mm_add_epi32(_mm_unpacklo_epi64(s01, s23), _mm_unpackhi_epi64(s01, s23));
+    sums = _mm_add_epi32(sums, _mm_set_epi32(skew[3], skew[2], skew[1], skew[0]));
+    sums = _mm_sra_epi32(sums, _mm_cvtsi32_si128(prob_shift));
+    alignas(16) int res[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(res), sums);
+    for (size_t i = 0; i < kCount; ++i) {
+      out[i] = res[i];
+    }
+  }
+
+  ALWAYS_INLINE static void Update(Mixer* const* mixers, const int* prs, uint32_t bit,
+    uint32_t prob_shift, int limit, int delta_round, int skew_learn, const int* learn_mults, size_t shift,
+    int p0 = 0, int p1 = 0, int p2 = 0, int p3 = 0, int p4 = 0, int p5 = 0, int p6 = 0, int p7 = 0,
+    int p8 = 0, int p9 = 0, int p10 = 0, int p11 = 0, int p12 = 0, int p13 = 0, int p14 = 0, int p15 = 0) {
+    const __m128i probs0 = _mm_slli_epi16(_mm_set_epi16(p7, p6, p5, p4, p3, p2, p1, p0), 4);
+    const __m128i probs1 = _mm_slli_epi16(_mm_set_epi16(p15, p14, p13, p12, p11, p10, p9, p8), 4);
+    for (size_t i = 0; i < kCount; ++i) {
+      // Same as Mixer16::Update.
+      Mixer* m = mixers[i];
+      const int64_t err = (static_cast<int64_t>(bit << prob_shift) - prs[i]) * learn_mults[i];
+      if (err >= static_cast<int64_t>(-delta_round) && err <= static_cast<int64_t>(delta_round)) {
+        continue;
+      }
+      const int64_t serr = std::max(std::min(err >> (shift + Mixer::kWeightShift - 12), static_cast<int64_t>(32767)),
+        static_cast<int64_t>(-32768));
+      const __m128i verr = _mm_set1_epi16(static_cast<int16_t>(serr));
+      __m128i* w = reinterpret_cast<__m128i*>(m->w_);
+      _mm_store_si128(w, _mm_adds_epi16(_mm_load_si128(w), _mm_mulhi_epi16(probs0, verr)));
+      if (kVecs > 1) {
+        _mm_store_si128(w + 1, _mm_adds_epi16(_mm_load_si128(w + 1), _mm_mulhi_epi16(probs1, verr)));
+      }
+      m->skew_ += static_cast<int>((err << skew_learn) >> Mixer::kWeightShift);
+      m->learn_ += m->learn_ < limit;
+    }
+  }
+};
+
 template <const uint32_t weights, const uint32_t fp_shift = 16, const uint32_t wshift = 7>
 class MMXMixer {
 public:
@@ -344,22 +546,34 @@ private:
   }
 };
 
+// Mixers are stored cache line aligned so that mixers which are a power of 2 bytes large never
+// straddle two lines.
 template <typename Mixer>
 class MixerArray {
-  std::vector<Mixer> mixers_;
+  MemMap storage_;
+  Mixer* mixers_ = nullptr;
+  size_t size_ = 0;
   Mixer* cur_mixers_;
 public:
+  MixerArray() = default;
+  // Owns the storage the mixer pointers point into.
+  MixerArray(const MixerArray&) = delete;
+  MixerArray& operator=(const MixerArray&) = delete;
+
   template <typename... Args>
   void Init(size_t count, Args... args) {
-    mixers_.resize(count);
-    for (auto& m : mixers_) {
-      m.Init(args...);
+    storage_.resize(count * sizeof(Mixer) + kCacheLineSize);
+    mixers_ = reinterpret_cast<Mixer*>(AlignUp(reinterpret_cast<uint8_t*>(storage_.getData()), kCacheLineSize));
+    size_ = count;
+    for (size_t i = 0; i < count; ++i) {
+      new (&mixers_[i]) Mixer;
+      mixers_[i].Init(args...);
     }
     SetContext(0);
   }
 
   ALWAYS_INLINE size_t Size() const {
-    return mixers_.size();
+    return size_;
   }
 
   ALWAYS_INLINE void SetContext(size_t ctx) {
@@ -58,15 +58,14 @@ public:
 };
 
 // Keeps track of stretched probabilities.
-// format is: <learn:8><prob:32><stp:16>
+// format is: <prob:32><stp:16>, the learn rate is shared by the whole map.
 template <size_t kProbs>
 class FastAdaptiveProbMap {
 public:
   static constexpr size_t kPShift = 31;
   static constexpr size_t kProbBits = 12;
   uint64_t probs_[kProbs];
-  static constexpr size_t kLearnShift = 32;
-  static constexpr size_t kSTPShift = kLearnShift + 8;
+  uint32_t learn_ = 9;
 public:
   size_t GetUpdater(size_t bit) const {
     return (bit << kPShift);
@@ -74,19 +73,15 @@ public:
   
   template <typename Table>
   ALWAYS_INLINE void SetP(size_t index, int p, Table& t) {
-    Set(index, p << (kPShift - kProbBits), 9, t.st(p));
+    Set(index, p << (kPShift - kProbBits), t.st(p));
   }
 
   template <typename Table>
   ALWAYS_INLINE void Update(size_t index, size_t bit_updater, const Table& table, size_t dummy = 0) {
-    uint64_t p = probs_[index];
-    p >>= 16;
-    const uint32_t lower = static_cast<uint32_t>(p);
-    const uint8_t learn = static_cast<uint8_t>(p >> kLearnShift);
-    p += (bit_updater - lower) >> learn;
-    const uint16_t st = table.st(lower >> (kPShift - kProbBits));
-    p = (p << 16) | st;
-    probs_[index] = p;
+    const uint32_t lower = static_cast<uint32_t>(probs_[index] >> 16);
+    const uint32_t p = lower + static_cast<uint32_t>(
+      static_cast<int64_t>(bit_updater - lower) >> learn_);
+    Set(index, p, table.st(lower >> (kPShift - kProbBits)));
   }
 
   ALWAYS_INLINE int GetP(size_t index) const {
@@ -99,19 +94,13 @@ public:
     return static_cast<int16_t>(static_cast<uint16_t>(probs_[index]));
   }
 
-  void SetLearn(size_t index, size_t learn) {
-    auto p = probs_[index];
-    p &= 0xFFFFFFFFFFFF;
-    p |= (learn << 48);
-    probs_[index] = p;
+  void SetLearn(size_t learn) {
+    learn_ = learn;
   }
 
 private:
-  ALWAYS_INLINE void Set(size_t index, uint32_t p, uint8_t learn, int16_t stp) {
-    uint64_t acc = learn;
-    acc = (acc << 32) | p;
-    acc = (acc << 16) | static_cast<uint16_t>(stp);
-    probs_[index] = acc;
+  ALWAYS_INLINE void Set(size_t index, uint32_t p, int16_t stp) {
+    probs_[index] = (static_cast<uint64_t>(p) << 16) | static_cast<uint16_t>(stp);
   }
 };
 
@@ -236,4 +236,122 @@ public:
   }
 };
 
+// Carryless binary arithmetic coder with 64 bit low / high bounds. The bounds share their top 32
+// bits about once every 32 coded bits, which is when a whole 32 bit word is written. There are no
+// carries and no per byte renormalization, the coding step itself is branch free. Only binary
+// decisions and direct bits are supported.
+class Range64 {
+  static constexpr uint32_t kWordBits = 32;
+  static constexpr uint64_t kWordMask = 0xFFFFFFFF;
+
+  uint64_t low_ = 0, high_ = ~static_cast<uint64_t>(0), code_ = 0;
+
+  ALWAYS_INLINE bool NeedsShift() const {
+    return ((low_ ^ high_) >> kWordBits) == 0;
+  }
+
+  ALWAYS_INLINE uint64_t Mid(uint32_t p, uint32_t shift) const {
+    return low_ + ((high_ - low_) >> shift) * p;
+  }
+
+  ALWAYS_INLINE void Update(uint32_t bit, uint64_t mid) {
+    high_ = bit ? mid : high_;
+    low_ = bit ? low_ : mid + 1;
+  }
+
+  template <typename TOut>
+  NO_INLINE void ShiftOut(TOut& out) {
+    // Only loops if low_ == high_.
+    do {
+      out.put32(static_cast<uint32_t>(high_ >> kWordBits));
+      low_ <<= kWordBits;
+      high_ = (high_ << kWordBits) | kWordMask;
+    } while (NeedsShift());
+  }
+
+  template <typename TIn>
+  NO_INLINE void ShiftIn(TIn& in) {
+    do {
+      code_ = (code_ << kWordBits) | in.get32();
+      low_ <<= kWordBits;
+      high_ = (high_ << kWordBits) | kWordMask;
+    } while (NeedsShift());
+  }
+
+public:
+  // p is the probability of a 1 bit.
+  ALWAYS_INLINE uint32_t getDecodedBit(uint32_t p, uint32_t shift) {
+    const uint64_t mid = Mid(p, shift);
+    const uint32_t bit = code_ <= mid;
+    Update(bit, mid);
+    return bit;
+  }
+
+  template <typename TOut>
+  ALWAYS_INLINE void encode(TOut& out, uint32_t bit, uint32_t p, uint32_t shift) {
+    assert(p < (1U << shift));
+    assert(p != 0U);
+    Update(bit, Mid(p, shift));
+    if (UNLIKELY(NeedsShift())) {
+      ShiftOut(out);
+    }
+  }
+
+  template <typename TIn>
+  ALWAYS_INLINE uint32_t decode(TIn& in, uint32_t p, uint32_t shift) {
+    assert(p < (1U << shift));
+    assert(p != 0U);
+    auto ret = getDecodedBit(p, shift);
+    Normalize(in);
+    return ret;
+  }
+
+  template <typename TOut>
+  void EncodeBits(TOut& out, uint32_t value, int num_bits) {
+    for (int i = num_bits - 1; i >= 0; --i) {
+      encode(out, (value >> i) & 1, 1U << 11, 12);
+    }
+  }
+
+  template <typename TIn>
+  uint32_t DecodeDirectBits(TIn& in, int num_bits) {
+    uint32_t result = 0;
+    for (int i = 0; i < num_bits; ++i) {
+      result = (result << 1) | decode(in, 1U << 11, 12);
+    }
+    return result;
+  }
+
+  template <typename TOut>
+  void encodeDirect(TOut& out, uint32_t start, uint32_t total) {
+    assert(start < total);
+    EncodeBits(out, start, bitSize(total - 1));
+  }
+
+  template <typename TIn>
+  uint32_t decodeDirect(TIn& in, uint32_t total) {
+    return DecodeDirectBits(in, bitSize(total - 1));
+  }
+
+  template <typename TOut>
+  void flush(TOut& out) {
+    out.put32(static_cast<uint32_t>(low_ >> kWordBits));
+    out.put32(static_cast<uint32_t>(low_));
+  }
+
+  template <typename TIn>
+  void initDecoder(TIn& in) {
+    *this = Range64();
+    code_ = static_cast<uint64_t>(in.get32()) << kWordBits;
+    code_ |= in.get32();
+  }
+
+  template <typename TIn>
+  ALWAYS_INLINE void Normalize(TIn& in) {
+    if (UNLIKELY(NeedsShift())) {
+      ShiftIn(in);
+    }
+  }
+};
+
 #endif
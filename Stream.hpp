@@ -162,6 +162,9 @@ public:
     pos_ += read_count;
     return read_count;
   }
+  virtual void seek(uint64_t pos) {
+    pos_ = buffer_ + std::min(pos, static_cast<uint64_t>(limit_ - buffer_));
+  }
   virtual uint64_t tell() const {
     return pos_ - buffer_;
   }
@@ -249,9 +252,26 @@ public:
     }
     return buffer[buffer_pos++];
   }
+  // Big endian, missing bytes past EOF read as 0xFF like get() & 0xFF.
+  ALWAYS_INLINE uint32_t get32() {
+    if (UNLIKELY(remain() < sizeof(uint32_t))) {
+      uint32_t ret = 0;
+      for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+        ret = (ret << 8) | (get() & 0xFF);
+      }
+      return ret;
+    }
+    const uint8_t* ptr = &buffer[buffer_pos];
+    buffer_pos += sizeof(uint32_t);
+    return (static_cast<uint32_t>(ptr[0]) << 24) | (static_cast<uint32_t>(ptr[1]) << 16) |
+      (static_cast<uint32_t>(ptr[2]) << 8) | static_cast<uint32_t>(ptr[3]);
+  }
   void put(int c) {
     unimplementedError(__FUNCTION__);
   }
+  void put32(uint32_t n) {
+    unimplementedError(__FUNCTION__);
+  }
   uint64_t tell() const {
     return stream->tell() + buffer_pos;
   }
@@ -292,10 +312,25 @@ public:
     }
     *(ptr_++) = c;
   }
+  // Big endian.
+  ALWAYS_INLINE void put32(uint32_t n) {
+    if (UNLIKELY(ptr_ + sizeof(n) > end())) {
+      flush();
+    }
+    ptr_[0] = static_cast<uint8_t>(n >> 24);
+    ptr_[1] = static_cast<uint8_t>(n >> 16);
+    ptr_[2] = static_cast<uint8_t>(n >> 8);
+    ptr_[3] = static_cast<uint8_t>(n);
+    ptr_ += sizeof(n);
+  }
   int get() {
     unimplementedError(__FUNCTION__);
     return 0;
   }
+  uint32_t get32() {
+    unimplementedError(__FUNCTION__);
+    return 0;
+  }
   uint64_t tell() const {
     return stream_->tell() + (ptr_ - buffer_);
   }
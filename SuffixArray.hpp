@@ -0,0 +1,168 @@
+/*	MCM file compressor
+
+  Copyright (C) 2015, Google Inc.
+  Authors: Mathieu Chartier
+
+  LICENSE
+
+    This file is part of the MCM file compressor.
+
+    MCM is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    MCM is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with MCM.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SUFFIX_ARRAY_HPP_
+#define _SUFFIX_ARRAY_HPP_
+
+#include <algorithm>
+#include <vector>
+
+#include "Util.hpp"
+
+// Suffix array construction by induced sorting (SA-IS, Nong, Zhang and Chan), linear time.
+class SuffixArray {
+public:
+  // Sorted start positions of the suffixes of data.
+  static void Build(const uint8_t* data, size_t n, std::vector<int32_t>* sa) {
+    sa->clear();
+    if (n == 0) {
+      return;
+    }
+    check(n < static_cast<size_t>(std::numeric_limits<int32_t>::max()));
+    // Shift the bytes up to add a unique smallest sentinel at the end.
+    std::vector<int32_t> s(n + 1);
+    for (size_t i = 0; i < n; ++i) {
+      s[i] = static_cast<int32_t>(data[i]) + 1;
+    }
+    s[n] = 0;
+    std::vector<int32_t> out(n + 1);
+    SAIS(&s[0], &out[0], static_cast<int32_t>(n + 1), 257);
+    // The sentinel suffix sorts first.
+    sa->assign(out.begin() + 1, out.end());
+  }
+
+private:
+  // Start (or end) of the bucket of each symbol.
+  static void GetBuckets(const int32_t* s, int32_t n, int32_t k, int32_t* bkt, bool end) {
+    std::fill(bkt, bkt + k, 0);
+    for (int32_t i = 0; i < n; ++i) {
+      ++bkt[s[i]];
+    }
+    int32_t sum = 0;
+    for (int32_t i = 0; i < k; ++i) {
+      sum += bkt[i];
+      bkt[i] = end ? sum : sum - bkt[i];
+    }
+  }
+
+  // Sorts the L type suffixes from the sorted LMS suffixes, then the S type ones.
+  static void Induce(const int32_t* s, int32_t* sa, int32_t n, int32_t k, const std::vector<uint8_t>& stype,
+                     int32_t* bkt) {
+    GetBuckets(s, n, k, bkt, false);
+    for (int32_t i = 0; i < n; ++i) {
+      const int32_t j = sa[i] - 1;
+      if (j >= 0 && !stype[j]) {
+        sa[bkt[s[j]]++] = j;
+      }
+    }
+    GetBuckets(s, n, k, bkt, true);
+    for (int32_t i = n - 1; i >= 0; --i) {
+      const int32_t j = sa[i] - 1;
+      if (j >= 0 && stype[j]) {
+        sa[--bkt[s[j]]] = j;
+      }
+    }
+  }
+
+  // s[n - 1] must be a unique smallest symbol, symbols are in [0, k).
+  static void SAIS(const int32_t* s, int32_t* sa, int32_t n, int32_t k) {
+    std::vector<uint8_t> stype(n);
+    stype[n - 1] = 1;
+    for (int32_t i = n - 2; i >= 0; --i) {
+      stype[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && stype[i + 1]);
+    }
+    auto is_lms = [&stype](int32_t i) {
+      return i > 0 && stype[i] && !stype[i - 1];
+    };
+    std::vector<int32_t> bkt(k);
+    // Sort the LMS substrings.
+    GetBuckets(s, n, k, &bkt[0], true);
+    std::fill(sa, sa + n, -1);
+    for (int32_t i = 1; i < n; ++i) {
+      if (is_lms(i)) {
+        sa[--bkt[s[i]]] = i;
+      }
+    }
+    Induce(s, sa, n, k, stype, &bkt[0]);
+    // Name the sorted LMS substrings, equal substrings get the same name.
+    int32_t n1 = 0;
+    for (int32_t i = 0; i < n; ++i) {
+      if (is_lms(sa[i])) {
+        sa[n1++] = sa[i];
+      }
+    }
+    std::fill(sa + n1, sa + n, -1);
+    int32_t name = 0;
+    int32_t prev = -1;
+    for (int32_t i = 0; i < n1; ++i) {
+      const int32_t pos = sa[i];
+      bool diff = prev == -1;
+      for (int32_t d = 0; !diff; ++d) {
+        if (s[pos + d] != s[prev + d] || stype[pos + d] != stype[prev + d]) {
+          diff = true;
+        } else if (d > 0 && (is_lms(pos + d) || is_lms(prev + d))) {
+          break;
+        }
+      }
+      if (diff) {
+        ++name;
+        prev = pos;
+      }
+      // LMS positions are at least two apart.
+      sa[n1 + pos / 2] = name - 1;
+    }
+    for (int32_t i = n - 1, j = n - 1; i >= n1; --i) {
+      if (sa[i] >= 0) {
+        sa[j--] = sa[i];
+      }
+    }
+    // Sort the LMS suffixes, recursing if the names are not unique.
+    int32_t* s1 = sa + n - n1;
+    if (name < n1) {
+      SAIS(s1, sa, n1, name);
+    } else {
+      for (int32_t i = 0; i < n1; ++i) {
+        sa[s1[i]] = i;
+      }
+    }
+    // Induce the full order from the sorted LMS suffixes.
+    for (int32_t i = 1, j = 0; i < n; ++i) {
+      if (is_lms(i)) {
+        s1[j++] = i;
+      }
+    }
+    for (int32_t i = 0; i < n1; ++i) {
+      sa[i] = s1[sa[i]];
+    }
+    std::fill(sa + n1, sa + n, -1);
+    GetBuckets(s, n, k, &bkt[0], true);
+    for (int32_t i = n1 - 1; i >= 0; --i) {
+      const int32_t j = sa[i];
+      sa[i] = -1;
+      sa[--bkt[s[j]]] = j;
+    }
+    Induce(s, sa, n, k, stype, &bkt[0]);
+  }
+};
+
+#endif
@@ -23,6 +23,277 @@
 
 #include "Compressor.hpp"
 
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Archive.hpp"
+#include "Dict.hpp"
+#include "LZPFilter.hpp"
+#include "Stream.hpp"
+#include "SuffixArray.hpp"
+
+// Discards std::cout output while in scope, the dictionary prints its statistics.
+class QuietStdout {
+public:
+  QuietStdout() {
+    std::cout.setstate(std::ios_base::badbit);
+  }
+  ~QuietStdout() {
+    std::cout.clear();
+  }
+};
+
+static std::vector<uint8_t> ReadAll(Stream* stream) {
+  std::vector<uint8_t> ret;
+  for (int c; (c = stream->get()) != EOF;) {
+    ret.push_back(static_cast<uint8_t>(c));
+  }
+  return ret;
+}
+
+// Reverse filters through put and flush like the archive does.
+template <typename FilterType>
+static std::vector<uint8_t> ReverseFilter(const std::vector<uint8_t>& filtered) {
+  std::vector<uint8_t> result;
+  WriteVectorStream wvs(&result);
+  FilterType filter(&wvs);
+  for (uint8_t c : filtered) {
+    filter.put(c);
+  }
+  filter.flush();
+  return result;
+}
+
+// Forward filters data, then reverse filters the output. Returns the filtered size.
+template <typename FilterType>
+static size_t FilterRoundTrip(const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> filtered;
+  {
+    ReadMemoryStream rms(&data);
+    FilterType filter(&rms);
+    filtered = ReadAll(&filter);
+  }
+  check(ReverseFilter<FilterType>(filtered) == data);
+  return filtered.size();
+}
+
+static void RunLZPFilterTests() {
+  std::mt19937 rng(0);
+  std::vector<uint8_t> block(3 * KB);
+  for (auto& c : block) {
+    c = static_cast<uint8_t>(rng());
+  }
+  check(FilterRoundTrip<LZPFilter>(std::vector<uint8_t>()) == 0);
+  check(FilterRoundTrip<LZPFilter>(block) >= block.size());
+  // Escape bytes which are not part of a match.
+  std::vector<uint8_t> escapes(1 * KB, 0xFE);
+  for (size_t i = 0; i < escapes.size(); i += 3) {
+    escapes[i] = static_cast<uint8_t>(rng());
+  }
+  FilterRoundTrip<LZPFilter>(escapes);
+  // Repeats of the block, a run longer than the longest match and escapes inside repeated data.
+  std::vector<uint8_t> data;
+  for (size_t i = 0; i < 8; ++i) {
+    data.insert(data.end(), block.begin(), block.end());
+    data.insert(data.end(), escapes.begin(), escapes.begin() + i * 100);
+  }
+  data.insert(data.end(), 64 * KB, 'a');
+  data.insert(data.end(), block.begin(), block.end());
+  check(FilterRoundTrip<LZPFilter>(data) < data.size() / 4);
+}
+
+// Compare against sorting the suffixes with plain string compares.
+static void CheckSuffixArray(const std::vector<uint8_t>& data) {
+  std::vector<int32_t> sa;
+  SuffixArray::Build(data.empty() ? nullptr : &data[0], data.size(), &sa);
+  std::vector<int32_t> expected(data.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    expected[i] = static_cast<int32_t>(i);
+  }
+  std::sort(expected.begin(), expected.end(), [&data](int32_t a, int32_t b) {
+    return std::lexicographical_compare(data.begin() + a, data.end(), data.begin() + b, data.end());
+  });
+  check(sa == expected);
+}
+
+static void RunSuffixArrayTests() {
+  std::mt19937 rng(0);
+  CheckSuffixArray(std::vector<uint8_t>());
+  CheckSuffixArray(std::vector<uint8_t>(1, 'a'));
+  CheckSuffixArray(std::vector<uint8_t>(1000, 'a'));
+  // Small alphabets repeat the LMS substrings, which makes SA-IS recurse.
+  for (size_t alphabet : { 2u, 4u, 256u }) {
+    std::vector<uint8_t> data(3000);
+    for (auto& c : data) {
+      c = static_cast<uint8_t>(rng() % alphabet);
+    }
+    CheckSuffixArray(data);
+  }
+  std::vector<uint8_t> data;
+  for (size_t i = 0; i < 200; ++i) {
+    const char* s = i % 7 == 0 ? "abcab" : "abc";
+    data.insert(data.end(), s, s + strlen(s));
+  }
+  CheckSuffixArray(data);
+}
+
+// Dictionary filter with phrases built from the text itself, like the archive does.
+static void RunDictFilterTests() {
+  static const char* const kWords[] = { "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel" };
+  std::mt19937 rng(0);
+  std::string text;
+  for (size_t i = 0; i < 400; ++i) {
+    text += "<tr><td class=\"name\">";
+    text += kWords[rng() % 8];
+    text += "</td><td class=\"value\">" + std::to_string(rng() % 1000) + "</td></tr>\n";
+    if (i % 5 == 0) {
+      text += "The ";
+      text += kWords[rng() % 8];
+      text += " row is shown Twice.\n";
+    }
+  }
+  const std::vector<uint8_t> data(text.begin(), text.end());
+  QuietStdout quiet;
+  Dict::Builder builder(4 * MB);
+  builder.EnablePhrases();
+  for (uint8_t c : data) {
+    builder.AddChar(c);
+  }
+  Dict::CodeWordSet code_words;
+  Dict::CodeWordGeneratorFast generator;
+  generator.Generate(builder, &code_words, 5, 40, 32, 128);
+  const auto& words = *code_words.GetCodeWords();
+  check(std::any_of(words.begin(), words.end(), [](const WordCount& wc) {
+    return wc.Word().find(' ') != std::string::npos || wc.Word().find('<') != std::string::npos;
+  }));
+  std::vector<uint8_t> filtered;
+  {
+    ReadMemoryStream rms(&data);
+    Dict::Filter filter(&rms, 0x3, 0x4, 0x6);
+    auto freq = builder.FrequencyCounter();
+    filter.AddCodeWords(code_words.GetCodeWords(), code_words.num1_, code_words.num2_, code_words.num3_, &freq, 128);
+    filter.SetFrequencies(freq);
+    filtered = ReadAll(&filter);
+  }
+  check(filtered.size() < data.size() / 2);
+  check(ReverseFilter<Dict::Filter>(filtered) == data);
+}
+
+// Analyze samples of the data, returns true if it ends up as one block with the profile.
+static bool SampledProfileIs(const std::vector<uint8_t>& data, Detector::Profile profile) {
+  Analyzer analyzer;
+  ReadMemoryStream rms(&data);
+  check(analyzer.analyzeSampled(&rms, data.size()));
+  const auto& blocks = analyzer.getBlocks();
+  return blocks.size() == 1 && blocks[0].profile() == profile && blocks[0].length() == data.size();
+}
+
+static void RunAnalyzerTests() {
+  std::mt19937 rng(0);
+  std::vector<uint8_t> data(1 * MB);
+  for (auto& c : data) {
+    c = static_cast<uint8_t>(rng());
+  }
+  check(SampledProfileIs(data, Detector::kProfileStore));
+  // 7.6 bits per byte is still worth modeling.
+  for (auto& c : data) {
+    c = static_cast<uint8_t>(rng() % 200);
+  }
+  check(SampledProfileIs(data, Detector::kProfileBinary));
+}
+
+// Contents of the file in the archive in RunLegacyArchiveTests.
+static std::string LegacyArchiveText() {
+  std::string ret;
+  for (size_t i = 0; i < 300; ++i) {
+    ret += "record " + std::to_string(i * 7919 % 1000) + " of the old archive\n";
+  }
+  return ret;
+}
+
+// Decompresses all the blocks of an in memory archive written by mcm 0.84.
+static std::string DecompressLegacyArchive(const uint8_t* data, size_t size) {
+  ReadMemoryStream rms(data, data + size);
+  Archive archive(&rms);
+  check(archive.getHeader().isArchive());
+  check(archive.getHeader().isSupportedVersion());
+  check(archive.getHeader().minorVersion() == 84);
+  archive.readBlocks();
+  std::vector<uint8_t> out;
+  WriteVectorStream wvs(&out);
+  for (auto& block : archive.getBlocks()) {
+    archive.decompressBlock(block.get(), &wvs);
+  }
+  return std::string(out.begin(), out.end());
+}
+
+// Contents of the file in the second archive in RunLegacyArchiveTests, longer than the 256KB
+// history at -m0 so that the match model searches across the wrap point.
+static std::string LegacyWrapText() {
+  const std::string words = "the quick brown fox jumps over the lazy dog and then some more words";
+  return std::string(262141, 'a') + words + std::string(1000, 'b') + words + std::string(100, 'c');
+}
+
+// Archives written by mcm 0.84 with -m0 -filter=none. The block headers don't have the 0.85 fields
+// and the CM streams, including the metadata, use the old hashes.
+static void RunLegacyArchiveTests() {
+  static const uint8_t kArchive[] = {
+    0x4D, 0x43, 0x4D, 0x41, 0x52, 0x43, 0x48, 0x49, 0x56, 0x45, 0x00, 0x00, 0x00, 0x54, 0x19, 0x00,
+    0xCE, 0xC0, 0xEC, 0x9F, 0x1E, 0x52, 0x4C, 0x2F, 0x34, 0x34, 0x96, 0xD4, 0xDD, 0xD3, 0x69, 0xB4,
+    0xDA, 0x08, 0xEA, 0x28, 0xBF, 0xA3, 0x49, 0xFD, 0x76, 0xD2, 0x09, 0x85, 0x46, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3D, 0x8E, 0x99, 0x61, 0xBC, 0xE1, 0xD5, 0x52, 0x9B, 0x3F,
+    0x75, 0x38, 0x66, 0x14, 0xE3, 0xA8, 0xAB, 0x76, 0x9F, 0xEF, 0x31, 0xE7, 0x37, 0x38, 0x66, 0xD1,
+    0x8F, 0xE7, 0x0C, 0xCE, 0xED, 0x09, 0xB9, 0xF8, 0x1E, 0xE0, 0xC5, 0xC0, 0x41, 0x56, 0x71, 0x95,
+    0x66, 0x86, 0x8F, 0x35, 0xD5, 0x8E, 0x2F, 0xF3, 0xAA, 0x1D, 0xA9, 0xCB, 0xF3, 0x82, 0x33, 0x39,
+    0x36, 0x57, 0x69, 0x98, 0xF1, 0x28, 0x72, 0x4A, 0xD5, 0xA2, 0x88, 0x59, 0xF7, 0x48, 0x2E, 0xDF,
+    0x0C, 0x17, 0x88, 0xA5, 0xFC, 0x47, 0x70, 0x8D, 0x90, 0xBE, 0x50, 0x21, 0x21, 0xF1, 0x12, 0x32,
+    0xE7, 0xDE, 0x7D, 0x68, 0x12, 0x06, 0x73, 0xE7, 0xD9, 0x03, 0xEF, 0xF5, 0xF5, 0x64, 0xDE, 0x21,
+    0x83, 0x77, 0x56, 0xA9, 0x65, 0xE2, 0x8D, 0x07, 0xA5, 0x43, 0x2A, 0xB2, 0x21, 0x6E, 0x0A, 0x89,
+    0x23, 0x2E, 0x3A, 0x48, 0xFF, 0xB3, 0xA8, 0xB9, 0xDF, 0x30, 0x1D, 0xE1, 0xFA, 0xCC, 0x22, 0x17,
+    0xBA, 0x82, 0x57, 0xE8, 0x26, 0x13, 0x45, 0xD2, 0x0F, 0x39, 0xBE, 0x64, 0xDA, 0x8C, 0x09, 0x7D,
+    0x1B, 0x8F, 0x9D, 0xE7, 0xC9, 0xD4, 0xA4, 0x80, 0x18, 0xCC, 0xC7, 0xAB, 0xF9, 0xF7, 0x12, 0xC1,
+    0x50, 0x08, 0x12, 0xA4, 0x88, 0xF5, 0x86, 0x31, 0x5C, 0x9C, 0xA9, 0x42, 0x44, 0x03, 0x11, 0xF2,
+    0x7B, 0x42, 0x1F, 0x9C, 0xCB, 0x75, 0x77, 0xB2, 0xBD, 0xFE, 0x64, 0x13, 0x7F, 0x33, 0x61, 0x10,
+    0xBB, 0xDE, 0x9D, 0xBE, 0xD0, 0x7A, 0x70, 0x30, 0xE6, 0x2C, 0x46, 0x43, 0x12, 0xCE, 0x9E, 0x44,
+    0xB6, 0x40, 0xBD, 0xBA, 0x2F, 0xC0, 0x60, 0xCF, 0x2D, 0x56, 0xB2, 0xC4, 0x9D, 0xDE, 0x78, 0x50,
+    0xE5, 0xD8, 0xA9, 0xEB, 0x9D, 0x12, 0xB7, 0x47, 0xC9, 0x40, 0x49, 0xBC, 0xF4, 0x11, 0xB0, 0xD9,
+    0x2F, 0xB1, 0xE4, 0x71, 0x5E, 0x25, 0x62, 0x91, 0xF8, 0x5A, 0x6C, 0x82, 0x3D, 0x24, 0xB1, 0xCC,
+    0xFB, 0x15, 0x00, 0xEB, 0x53, 0x4C, 0x26, 0x6A, 0x62, 0x41, 0x6E, 0xD5, 0xED, 0x00, 0xB0, 0xC1,
+    0x1C, 0x6B, 0x06, 0x05, 0x34, 0x94, 0x36, 0x3F, 0x9C, 0x16, 0x5C, 0xC1, 0x3A, 0xBC, 0x53, 0x9E,
+    0x01, 0x97, 0x04, 0x75, 0x2B, 0xC8, 0xBF, 0x9D, 0x73, 0x7D, 0x69, 0x29, 0xFF, 0x57, 0x88, 0x68,
+    0x52, 0x70, 0x8A, 0x95, 0xD9, 0x06, 0x27, 0xBD, 0x9D, 0x2F, 0x41, 0xF7, 0xE1, 0xB9, 0xC9, 0xE0,
+    0x90, 0x65, 0xC2, 0x3B, 0xBB, 0xBB, 0xE7, 0x60, 0x08, 0x00, 0x6B, 0x3F, 0x6F, 0x70, 0xB5, 0xCF,
+    0xFE, 0x3C, 0x47, 0x61, 0xFD, 0x6F, 0x08, 0x31, 0x21, 0xC1, 0x02, 0x93, 0x8A, 0x00, 0x87, 0x1E,
+    0x46, 0x46, 0x88, 0x8D, 0x5A, 0x2C, 0x5D, 0x57, 0x78, 0xBA, 0x4E, 0xF0, 0x57, 0x84, 0x2F, 0x4F,
+    0xF5, 0x53, 0x9B, 0xFE, 0x02, 0xEC, 0x7F, 0xC8, 0xCF, 0x27, 0xEC, 0x12, 0xC0, 0xFC, 0x37, 0xF2,
+    0x25, 0x21, 0x75, 0xB7, 0xE3, 0xF3, 0x95, 0xDA, 0x9D, 0x50, 0x72, 0x97, 0x15, 0x39, 0x0D, 0x16,
+    0xC3, 0xD4, 0x56, 0x97, 0xAC, 0x21, 0x38, 0xFD, 0xB3, 0xA2, 0x08, 0xDE, 0xC6, 0xD0, 0xFA, 0x6D,
+    0xFA, 0xB3, 0xB4, 0x41, 0x52, 0x60, 0x9D, 0x07, 0x26, 0x70, 0xB2, 0x37, 0xD4, 0x8A, 0xC3, 0xE2,
+    0xCE, 0x95, 0x80, 0xAC, 0x9C, 0x4C, 0x12, 0x08, 0xEB, 0xB0, 0xC5, 0x4B, 0x86,
+  };
+  check(DecompressLegacyArchive(kArchive, sizeof(kArchive)) == LegacyArchiveText());
+  static const uint8_t kWrapArchive[] = {
+    0x4D, 0x43, 0x4D, 0x41, 0x52, 0x43, 0x48, 0x49, 0x56, 0x45, 0x00, 0x00, 0x00, 0x54, 0x17, 0x00,
+    0xCE, 0xC0, 0xEC, 0x9F, 0x95, 0x26, 0xA5, 0x8E, 0x42, 0xC6, 0xE5, 0xDC, 0x53, 0x06, 0x51, 0x2C,
+    0xF3, 0x2E, 0x58, 0x0C, 0x7F, 0x10, 0xE5, 0xD2, 0x09, 0xD1, 0x89, 0x10, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0xD5, 0x6A, 0x74, 0x7E, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x78, 0x02,
+    0x16, 0x43, 0x02, 0xEF, 0x26, 0x5B, 0xB6, 0x6C, 0x29, 0x7D, 0xDC, 0x5A, 0x32, 0x2D, 0x6F, 0x24,
+    0x8D, 0x40, 0x76, 0x80, 0x1C, 0xDC, 0xD9, 0x81, 0xC7, 0xCA, 0xD5, 0xCA, 0xD8, 0x42, 0x1D, 0xD5,
+    0xE8, 0x0C, 0x26, 0xE7, 0x7F, 0x37, 0x1A, 0xDE, 0xD7, 0xAB, 0xE2, 0x96, 0x4C, 0x1D, 0xD8, 0xFE,
+    0x4C, 0xD1, 0xDC, 0xB2, 0x38, 0xBC, 0x98, 0x21, 0x0C, 0x28, 0x2B, 0xB7, 0x6C, 0x05,
+  };
+  check(DecompressLegacyArchive(kWrapArchive, sizeof(kWrapArchive)) == LegacyWrapText());
+}
+
 void RunAllTests() {
   RunUtilTests();
+  RunLZPFilterTests();
+  RunAnalyzerTests();
+  RunSuffixArrayTests();
+  RunDictFilterTests();
+  RunLegacyArchiveTests();
 }
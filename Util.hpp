@@ -43,8 +43,8 @@
 #define ALWAYS_INLINE __forceinline
 #define NO_INLINE __declspec(noinline)
 #else
-#define ALWAYS_INLINE __attribute__((always_inline))
-#define NO_INLINE __declspec(noinline)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#define NO_INLINE __attribute__((noinline))
 #endif
 
 #define no_alias __restrict
@@ -83,6 +83,17 @@ ALWAYS_INLINE void Prefetch(const void* ptr) {
 #endif
 }
 
+// Index of the lowest set bit, n must not be 0.
+ALWAYS_INLINE uint32_t CountTrailingZeros(uint32_t n) {
+#ifdef WIN32
+  unsigned long idx;
+  _BitScanForward(&idx, n);
+  return static_cast<uint32_t>(idx);
+#else
+  return static_cast<uint32_t>(__builtin_ctz(n));
+#endif
+}
+
 ALWAYS_INLINE static bool IsUpperCase(int c) {
   return c >= 'A' && c <= 'Z';
 }
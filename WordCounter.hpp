@@ -24,7 +24,10 @@
 #ifndef _WORD_COUNTER_HPP_
 #define _WORD_COUNTER_HPP_
 
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "Memory.hpp"
@@ -155,7 +158,17 @@ public:
   static constexpr size_t kMaxLength = 256;
 
   ~WordCounter() {
-    std::cerr << std::endl << "Word counter used " << Used() << " hash size " << hash_mask_ << std::endl;
+    if (mem_map_.getSize() != 0) {
+      std::cerr << std::endl << "Word counter used " << Used() << " hash size " << hash_mask_ << std::endl;
+    }
+  }
+
+  bool IsInit() const {
+    return mem_map_.getSize() != 0;
+  }
+
+  static uint32_t Hash(const uint8_t* word, size_t len) {
+    return Entry::ComputeHash(word, len);
   }
 
   void Init(size_t memory) {
@@ -192,7 +205,7 @@ public:
     auto start = clock();
     auto cur = begin_;
     auto dest = begin_;
-    while (cur < end_) {
+    while (cur < ptr_) {
       auto* cur_entry = reinterpret_cast<Entry*>(cur);
       auto size = cur_entry->SizeOf();
       if (cur_entry->Count() >= min_count) {
@@ -342,7 +355,7 @@ private:
   // Return hash table index.
   uint32_t Lookup(const uint8_t* word, size_t len) {
     auto h = Entry::ComputeHash(word, len);
-    auto index = h % hash_mask_;
+    auto index = h & hash_mask_;
     for (;;) {
       auto slot = hash_table_[index];
       if (slot == kInvalidPos) break;
@@ -377,14 +390,173 @@ private:
 
   // Minimum count for keeping.
   size_t min_count_ = 2;
-  uint8_t* begin_;
-  uint8_t* ptr_;
-  uint8_t* end_;
+  uint8_t* begin_ = nullptr;
+  uint8_t* ptr_ = nullptr;
+  uint8_t* end_ = nullptr;
   MemMap mem_map_;
-  uint32_t* hash_table_;
-  size_t hash_mask_;
-  uint32_t pos_mask_;
+  uint32_t* hash_table_ = nullptr;
+  size_t hash_mask_ = 0;
+  uint32_t pos_mask_ = 0;
   static constexpr uint32_t kInvalidPos = 0xFFFFFFFF;
 };
 
+// Splits the words by hash between kShards word counters, each counting on its own thread. The
+// shard count does not depend on the machine and every shard sees its words in input order, so the
+// counts and GCs are the same for every run. Memory and threads are only allocated once the first
+// word is added.
+class ShardedWordCounter {
+  static const size_t kShardBits = 2;
+  static const size_t kShards = 1u << kShardBits;
+  // Bytes of queued words before they are handed to the shard thread.
+  static const size_t kBatchSize = 256 * KB;
+public:
+  // Memory is split evenly between the shards. With a single core the shards count on the calling
+  // thread, the counts are the same.
+  void Init(size_t memory) {
+    const bool threaded = std::thread::hardware_concurrency() > 1;
+    for (auto& shard : shards_) {
+      shard.Init(memory / kShards, threaded);
+    }
+  }
+
+  void AddWord(const uint8_t* begin, const uint8_t* end, WordCC cc_type) {
+    const size_t len = end - begin;
+    dcheck(len < WordCounter::kMaxLength);
+    // High bits, the shard counters index their hash table with the low bits.
+    const size_t shard = (WordCounter::Hash(begin, len) * 0x9E3779B1u) >> (32 - kShardBits);
+    shards_[shard].AddWord(begin, len, cc_type);
+  }
+
+  // Shards in order, the words of a shard are in the order they were first seen.
+  void GetWords(std::vector<WordCount>& out, size_t min_occurences) {
+    for (auto& shard : shards_) {
+      shard.Wait();
+      shard.counter_.GetWords(out, min_occurences);
+    }
+  }
+
+  // Frees the memory and stops the threads, adding a word after this starts over.
+  void Clear() {
+    for (auto& shard : shards_) {
+      shard.Clear();
+    }
+  }
+
+private:
+  class Shard {
+  public:
+    ~Shard() {
+      Stop();
+    }
+
+    void Init(size_t memory, bool threaded) {
+      memory_ = memory;
+      threaded_ = threaded;
+    }
+
+    // Queued words are <length> <case> <chars>.
+    ALWAYS_INLINE void AddWord(const uint8_t* word, size_t len, WordCC cc_type) {
+      if (!threaded_) {
+        if (!counter_.IsInit()) {
+          counter_.Init(memory_);
+        }
+        counter_.AddWord(word, word + len, cc_type);
+        return;
+      }
+      if (filling_.size() + len + 2 > kBatchSize) {
+        Dispatch();
+      }
+      filling_.push_back(static_cast<uint8_t>(len));
+      filling_.push_back(static_cast<uint8_t>(cc_type));
+      filling_.insert(filling_.end(), word, word + len);
+    }
+
+    // Waits until all the queued words are counted.
+    void Wait() {
+      Dispatch();
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this]() { return !has_batch_; });
+    }
+
+    // The thread holds no counts of its own, the counter is freed once it has taken the last batch.
+    void Clear() {
+      Wait();
+      Stop();
+      counter_.Clear();
+    }
+
+    WordCounter counter_;
+
+  private:
+    // Joins the thread, a later Dispatch starts a new one.
+    void Stop() {
+      if (thread_ != nullptr) {
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          done_ = true;
+          cond_.notify_all();
+        }
+        thread_->join();
+        delete thread_;
+        thread_ = nullptr;
+        done_ = false;
+      }
+    }
+
+    void Dispatch() {
+      if (filling_.empty()) {
+        return;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (thread_ == nullptr) {
+        counter_.Init(memory_);
+        thread_ = new std::thread(Callback, this);
+      }
+      cond_.wait(lock, [this]() { return !has_batch_; });
+      batch_.swap(filling_);
+      filling_.clear();
+      has_batch_ = true;
+      cond_.notify_all();
+    }
+
+    void Run() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (;;) {
+        cond_.wait(lock, [this]() { return has_batch_ || done_; });
+        if (!has_batch_) {
+          return;
+        }
+        // The producer does not touch the batch until has_batch_ is cleared.
+        lock.unlock();
+        for (size_t pos = 0; pos < batch_.size(); ) {
+          const size_t len = batch_[pos];
+          const auto cc_type = static_cast<WordCC>(batch_[pos + 1]);
+          const uint8_t* word = &batch_[pos + 2];
+          counter_.AddWord(word, word + len, cc_type);
+          pos += len + 2;
+        }
+        lock.lock();
+        has_batch_ = false;
+        cond_.notify_all();
+      }
+    }
+
+    static void Callback(Shard* shard) {
+      shard->Run();
+    }
+
+    std::vector<uint8_t> filling_;
+    std::vector<uint8_t> batch_;
+    size_t memory_ = 0;
+    bool threaded_ = false;
+    bool has_batch_ = false;
+    bool done_ = false;
+    std::thread* thread_ = nullptr;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+  };
+
+  Shard shards_[kShards];
+};
+
 #endif